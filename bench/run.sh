@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Runs each workload with `lll -q -s` and prints one tab-separated
+# line per workload: its name, the best wall time of $BENCH_RUNS runs
+# in milliseconds, and the bytes allocated, collections and peak RSS
+# of that run.
+#
+#   usage: bench/run.sh [lll] [workload...]
+#
+# The symbols and parse workloads read files generated into a
+# temporary directory; the rest are the .l files next to this script.
+
+LLL=${1:-./lll}
+[ $# -gt 0 ] && shift
+RUNS=${BENCH_RUNS:-3}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/lll-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+# 200000 symbols, 1 in 10 of them distinct, in quoted lists of 10
+awk 'BEGIN {
+  for (i = 0; i < 20000; i++) {
+    printf "(quote (";
+    for (j = 0; j < 10; j++) printf " sym-%d-%d", (i * 7 + j) % 20000, j % 2;
+    print "))";
+  }
+}' > "$TMP/symbols.l"
+
+# about 8MB of nested data with strings and numbers
+awk 'BEGIN {
+  for (i = 0; i < 40000; i++) {
+    printf "(quote (record %d \"name %d\" (%d.%d -%d) ((a b) (c (d e)))", i, i, i, i % 100, i;
+    print " \"a somewhat longer string of text to skip over\" :key 1 2 3 4 5 6 7))";
+  }
+}' > "$TMP/parse.l"
+
+if [ $# -eq 0 ]; then
+  set -- calls numeric lists symbols parse print vectors hashes strings
+fi
+
+printf 'workload\twall_ms\talloc_bytes\tminor_gcs\tmajor_gcs\tmax_rss_kb\n'
+for w in "$@"; do
+  if [ -f "$TMP/$w.l" ]; then
+    file="$TMP/$w.l"
+  else
+    file="$DIR/$w.l"
+  fi
+  best=
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    stats=$("$LLL" -q -s "$file" 2>&1 >/dev/null | grep '^; stats ') || {
+      echo "$w: failed" >&2
+      exit 1
+    }
+    wall=$(echo "$stats" | sed 's/.*wall_ms=\([^ ]*\).*/\1/')
+    if [ -z "$best" ] || awk "BEGIN { exit !($wall < $best) }"; then
+      best=$wall
+      line=$stats
+    fi
+    i=$((i + 1))
+  done
+  echo "$line" | awk -v w="$w" '{
+    for (i = 3; i <= NF; i++) { split($i, kv, "="); v[kv[1]] = kv[2] }
+    printf "%s\t%s\t%s\t%s\t%s\t%s\n", w, v["wall_ms"], v["alloc_bytes"],
+      v["minor_gcs"], v["major_gcs"], v["max_rss_kb"]
+  }'
+done
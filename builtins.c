@@ -1,73 +1,45 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
 #include "lll.h"
 
 static obj_t *
-builtin_cons(sn_t *S, obj_t *args)
-{
-  obj_t *a, *d;
-  int l = length(S, args);
-  switch (l) {
-  case 1:
-    fprintf(stderr, "PROMISEs aren't implemented yet\n");
-    return NULL;
-  case 2:
-    /* essentially, POPARG */
-    d = car(S, args);
-    args = cdr(S, args);
-    a = car(S, args);
-    return cons(S, a, d);
-  case 0:
-  default:
-    fprintf(stderr, "ARITY_ERROR: cons requires 2 arguments\n");
-    exit(EXIT_FAILURE);
-  }
-  return NULL;
+builtin_cons(sn_t *S, int argc, obj_t **argv)
+{
+  return cons(S, argv[0], argv[1]);
 }
 
 static obj_t *
-builtin_list(sn_t *S, obj_t *args)
+builtin_list(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *accum = S->NIL, *tmp;
-  for (; args != S->NIL && args != NULL; args = cdr(S, args)) {
-    tmp = car(S, args);
-    accum = cons(S, tmp, accum);
+  obj_t *accum = S->NIL;
+
+  GC_PROTECT(S, accum);
+  while (argc-- > 0) {
+    accum = cons(S, argv[argc], accum);
   }
+  GC_UNPROTECT(S, 1);
   return accum;
 }
 
 static obj_t *
-builtin_nil_p(sn_t *S, obj_t *args)
+builtin_nil_p(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *arg;
-  int l = length(S, args);
-  if (l == 1) {
-    arg = car(S, args);
-    return (arg == NULL || arg == S->NIL) ? intern(S, ":true", 5) : S->NIL;
-  }
-  fprintf(stderr, "ARITY_ERROR: nil? requires 1 argument\n");
-  exit(EXIT_FAILURE);
-
-  return NULL;
+  return (argv[0] == NULL || argv[0] == S->NIL) ? S->TRUE : S->NIL;
 }
 
 static obj_t *
-builtin_list_head(sn_t *S, obj_t *args)
+builtin_list_head(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *arg;
-  int l = length(S, args);
-  if (l != 1) {
-    fprintf(stderr, "ARITY_ERROR: head requires a single argument\n");
-    exit(EXIT_FAILURE);
-  }
-
-  arg = car(S, args);
+  obj_t *arg = argv[0];
 
   if (arg == NULL || arg == S->NIL) {
     return S->NIL;
   }
 
-  if (arg->flag == CONS_T) {
+  if (FLAG_P(arg, CONS_T)) {
     return car(S, arg);
   }  
   
@@ -77,22 +49,15 @@ builtin_list_head(sn_t *S, obj_t *args)
 }
 
 static obj_t *
-builtin_list_rest(sn_t *S, obj_t *args)
+builtin_list_rest(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *arg;
-  int l = length(S, args);
-  if (l != 1) {
-    fprintf(stderr, "ARITY_ERROR: rest requires a single argument\n");
-    exit(EXIT_FAILURE);
-  }
-
-  arg = car(S, args);
+  obj_t *arg = argv[0];
 
   if (arg == NULL || arg == S->NIL) {
     return S->NIL;
   }
 
-  if (arg->flag == CONS_T) {
+  if (FLAG_P(arg, CONS_T)) {
     return cdr(S, arg);
   }  
   
@@ -102,21 +67,14 @@ builtin_list_rest(sn_t *S, obj_t *args)
 }
 
 static obj_t *
-builtin_list_empty_p(sn_t *S, obj_t *args)
+builtin_list_empty_p(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *arg;
-  int l = length(S, args);
-  if (l != 1) {
-    fprintf(stderr, "ARITY_ERROR: empty? requires a single argument\n");
-    exit(EXIT_FAILURE);
-  }
-
-  arg = car(S, args);
+  obj_t *arg = argv[0];
 
   if (arg == NULL || arg == S->NIL) {
-    return intern(S, ":true", 5);
+    return S->TRUE;
   }
-  else if (arg->flag == CONS_T) {
+  else if (FLAG_P(arg, CONS_T)) {
     return S->NIL;
   }
   
@@ -127,28 +85,447 @@ builtin_list_empty_p(sn_t *S, obj_t *args)
 }
 
 static obj_t *
-builtin_module_set_b(sn_t *S, obj_t *args)
+builtin_module_set_b(sn_t *S, int argc, obj_t **argv)
 {
-  obj_t *name, *value, *frame, *tmp;
-  int l = length(S, args);
-  if (l != 2) {
-    fprintf(stderr, "ARITY_ERROR: module-set! requires 2 arguments\n");
+  obj_t *name = argv[0], *value = argv[1];
+
+  if (!FLAG_P(name, ATOM_T) || name->atom.flag != SYMBOL_T) {
+    fprintf(stderr, "TYPE_ERROR: module-set! requires a symbol\n");
     exit(EXIT_FAILURE);
   }
 
-  name = car(S, args);
-  value = car(S, cdr(S, args));
+  global_set(S, name, value);
+
+  return S->NIL;
+}
+
+static obj_t *
+builtin_pr_str(sn_t *S, int argc, obj_t **argv)
+{
+  return print_to_string(S, argv[0]);
+}
+
+/**
+ * Numbers. Arithmetic is done on unboxed num_t values, so folding over
+ * any number of arguments allocates only the result. Fixnums stay
+ * fixnums, as long as they don't overflow a long, or divide unevenly;
+ * otherwise, or if any argument is a flonum, the result is a flonum.
+ */
+typedef struct num {
+  int flo;
+  long fix;
+  double d;
+} num_t;
+
+typedef enum num_op {
+  NUM_ADD,
+  NUM_SUB,
+  NUM_MUL,
+  NUM_DIV
+} num_op_t;
+
+typedef enum num_cmp {
+  NUM_EQ,
+  NUM_LT,
+  NUM_GT,
+  NUM_LE,
+  NUM_GE
+} num_cmp_t;
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define ADD_OVERFLOW(a, b, r) __builtin_add_overflow((a), (b), (r))
+#define SUB_OVERFLOW(a, b, r) __builtin_sub_overflow((a), (b), (r))
+#define MUL_OVERFLOW(a, b, r) __builtin_mul_overflow((a), (b), (r))
+#else
+static int
+add_overflow(long a, long b, long *r)
+{
+  if ((b > 0 && a > LONG_MAX - b) || (b < 0 && a < LONG_MIN - b)) {
+    return 1;
+  }
+  *r = a + b;
+  return 0;
+}
+
+static int
+sub_overflow(long a, long b, long *r)
+{
+  if ((b < 0 && a > LONG_MAX + b) || (b > 0 && a < LONG_MIN + b)) {
+    return 1;
+  }
+  *r = a - b;
+  return 0;
+}
+
+static int
+mul_overflow(long a, long b, long *r)
+{
+  if (a != 0 && b != 0
+      && ((a == -1 && b == LONG_MIN) || (b == -1 && a == LONG_MIN)
+          || (a != -1 && b != -1 && (a * b) / b != a))) {
+    return 1;
+  }
+  *r = a * b;
+  return 0;
+}
+#define ADD_OVERFLOW(a, b, r) add_overflow((a), (b), (r))
+#define SUB_OVERFLOW(a, b, r) sub_overflow((a), (b), (r))
+#define MUL_OVERFLOW(a, b, r) mul_overflow((a), (b), (r))
+#endif
+
+static void
+num_get(obj_t *o, num_t *n, const char *name)
+{
+  if (FIXNUM_P(o)) {
+    n->flo = 0;
+    n->fix = FIXNUM_VAL(o);
+    return;
+  }
+  else if (FLAG_P(o, ATOM_T)) {
+    if (o->atom.flag == FIXNUM_T) {
+      n->flo = 0;
+      n->fix = o->atom.fixnum;
+      return;
+    }
+    else if (o->atom.flag == FLONUM_T) {
+      n->flo = 1;
+      n->d = o->atom.flonum;
+      return;
+    }
+  }
+  fprintf(stderr, "TYPE_ERROR: %s requires numbers\n", name);
+  exit(EXIT_FAILURE);
+}
+
+static obj_t *
+num_box(sn_t *S, num_t *n)
+{
+  return n->flo ? mk_flonum(S, n->d) : mk_fixnum(S, n->fix);
+}
+
+static void
+num_float(num_t *n)
+{
+  if (!n->flo) {
+    n->flo = 1;
+    n->d = (double)n->fix;
+  }
+}
+
+/* acc = acc op x */
+static void
+num_apply(num_op_t op, num_t *acc, num_t *x)
+{
+  long r;
+
+  if (!acc->flo && !x->flo) {
+    switch (op) {
+    case NUM_ADD:
+      if (!ADD_OVERFLOW(acc->fix, x->fix, &r)) {
+        acc->fix = r;
+        return;
+      }
+      break;
+    case NUM_SUB:
+      if (!SUB_OVERFLOW(acc->fix, x->fix, &r)) {
+        acc->fix = r;
+        return;
+      }
+      break;
+    case NUM_MUL:
+      if (!MUL_OVERFLOW(acc->fix, x->fix, &r)) {
+        acc->fix = r;
+        return;
+      }
+      break;
+    case NUM_DIV:
+      if (x->fix == 0) {
+        fprintf(stderr, "ARITHMETIC_ERROR: Division by zero\n");
+        exit(EXIT_FAILURE);
+      }
+      if (!(acc->fix == LONG_MIN && x->fix == -1) && acc->fix % x->fix == 0) {
+        acc->fix /= x->fix;
+        return;
+      }
+      break;
+    }
+  }
+
+  num_float(acc);
+  num_float(x);
+  switch (op) {
+  case NUM_ADD:
+    acc->d += x->d;
+    break;
+  case NUM_SUB:
+    acc->d -= x->d;
+    break;
+  case NUM_MUL:
+    acc->d *= x->d;
+    break;
+  case NUM_DIV:
+    acc->d /= x->d;
+    break;
+  }
+}
+
+static obj_t *
+num_arith(sn_t *S, num_op_t op, int argc, obj_t **argv, const char *name)
+{
+  num_t acc, x;
+  int i;
+
+  if (argc == 0) {
+    return MK_FIXNUM(op == NUM_MUL ? 1 : 0);
+  }
+
+  if (argc == 1 && (op == NUM_SUB || op == NUM_DIV)) {
+    /* (- x) is 0 - x, and (/ x) is 1 / x */
+    acc.flo = 0;
+    acc.fix = op == NUM_SUB ? 0 : 1;
+    num_get(argv[0], &x, name);
+    num_apply(op, &acc, &x);
+  }
+  else {
+    num_get(argv[0], &acc, name);
+    for (i = 1; i < argc; i++) {
+      num_get(argv[i], &x, name);
+      num_apply(op, &acc, &x);
+    }
+  }
+  return num_box(S, &acc);
+}
+
+/* Two immediate fixnums, whose sum or difference fits in a long */
+#define FIXNUM_PAIR_P(argc, argv) \
+  ((argc) == 2 && FIXNUM_P((argv)[0]) && FIXNUM_P((argv)[1]))
+
+static obj_t *
+builtin_add(sn_t *S, int argc, obj_t **argv)
+{
+  if (FIXNUM_PAIR_P(argc, argv)) {
+    return mk_fixnum(S, (long)FIXNUM_VAL(argv[0]) + FIXNUM_VAL(argv[1]));
+  }
+  return num_arith(S, NUM_ADD, argc, argv, "+");
+}
+
+static obj_t *
+builtin_subtract(sn_t *S, int argc, obj_t **argv)
+{
+  if (FIXNUM_PAIR_P(argc, argv)) {
+    return mk_fixnum(S, (long)FIXNUM_VAL(argv[0]) - FIXNUM_VAL(argv[1]));
+  }
+  return num_arith(S, NUM_SUB, argc, argv, "-");
+}
+
+static obj_t *
+builtin_multiply(sn_t *S, int argc, obj_t **argv)
+{
+  long r;
+
+  if (FIXNUM_PAIR_P(argc, argv)
+      && !MUL_OVERFLOW((long)FIXNUM_VAL(argv[0]), (long)FIXNUM_VAL(argv[1]),
+                       &r)) {
+    return mk_fixnum(S, r);
+  }
+  return num_arith(S, NUM_MUL, argc, argv, "*");
+}
+
+static obj_t *
+builtin_divide(sn_t *S, int argc, obj_t **argv)
+{
+  return num_arith(S, NUM_DIV, argc, argv, "/");
+}
+
+static obj_t *
+builtin_mod(sn_t *S, int argc, obj_t **argv)
+{
+  num_t a, b;
+
+  num_get(argv[0], &a, "%");
+  num_get(argv[1], &b, "%");
+
+  if (!a.flo && !b.flo) {
+    if (b.fix == 0) {
+      fprintf(stderr, "ARITHMETIC_ERROR: Division by zero\n");
+      exit(EXIT_FAILURE);
+    }
+    /* LONG_MIN % -1 overflows in C */
+    return mk_fixnum(S, b.fix == -1 ? 0 : a.fix % b.fix);
+  }
+  num_float(&a);
+  num_float(&b);
+  a.d = fmod(a.d, b.d);
+  return num_box(S, &a);
+}
+
+static int
+num_test(num_cmp_t cmp, num_t *a, num_t *b)
+{
+  if (!a->flo && !b->flo) {
+    switch (cmp) {
+    case NUM_EQ: return a->fix == b->fix;
+    case NUM_LT: return a->fix < b->fix;
+    case NUM_GT: return a->fix > b->fix;
+    case NUM_LE: return a->fix <= b->fix;
+    case NUM_GE: return a->fix >= b->fix;
+    }
+  }
+
+  num_float(a);
+  num_float(b);
+  switch (cmp) {
+  case NUM_EQ: return a->d == b->d;
+  case NUM_LT: return a->d < b->d;
+  case NUM_GT: return a->d > b->d;
+  case NUM_LE: return a->d <= b->d;
+  case NUM_GE: return a->d >= b->d;
+  }
+  return 0;
+}
+
+/* Whether cmp holds between each argument and the next */
+static obj_t *
+num_compare(sn_t *S, num_cmp_t cmp, int argc, obj_t **argv,
+            const char *name)
+{
+  num_t a, b;
+  int i, holds = 1;
+
+  if (FIXNUM_PAIR_P(argc, argv)) {
+    a.flo = b.flo = 0;
+    a.fix = FIXNUM_VAL(argv[0]);
+    b.fix = FIXNUM_VAL(argv[1]);
+    return num_test(cmp, &a, &b) ? S->TRUE : S->NIL;
+  }
+
+  num_get(argv[0], &a, name);
+  for (i = 1; i < argc; i++) {
+    num_get(argv[i], &b, name);
+    if (holds && !num_test(cmp, &a, &b)) {
+      holds = 0; /* but the rest still have to be numbers */
+    }
+    a = b;
+  }
+  return holds ? S->TRUE : S->NIL;
+}
+
+static obj_t *
+builtin_num_eq(sn_t *S, int argc, obj_t **argv)
+{
+  return num_compare(S, NUM_EQ, argc, argv, "=");
+}
+
+static obj_t *
+builtin_lt(sn_t *S, int argc, obj_t **argv)
+{
+  return num_compare(S, NUM_LT, argc, argv, "<");
+}
+
+static obj_t *
+builtin_gt(sn_t *S, int argc, obj_t **argv)
+{
+  return num_compare(S, NUM_GT, argc, argv, ">");
+}
+
+static obj_t *
+builtin_le(sn_t *S, int argc, obj_t **argv)
+{
+  return num_compare(S, NUM_LE, argc, argv, "<=");
+}
 
-  frame = car(S, S->Toplevel_Env);
-  frame->cons.car = cons(S, value, frame->cons.car);
-  frame->cons.cdr = cons(S, name, frame->cons.cdr);
+static obj_t *
+builtin_ge(sn_t *S, int argc, obj_t **argv)
+{
+  return num_compare(S, NUM_GE, argc, argv, ">=");
+}
 
+/* Writes the arguments to stdout, separated by spaces */
+static obj_t *
+builtin_pr(sn_t *S, int argc, obj_t **argv)
+{
+  writer_t w;
+  int i;
+
+  writer_init(&w, stdout);
+  for (i = 0; i < argc; i++) {
+    write_object(S, &w, argv[i]);
+    if (i + 1 < argc) {
+      writer_put(&w, " ", 1);
+    }
+  }
+  writer_free(&w);
+
+  return S->NIL;
+}
+
+static obj_t *
+builtin_prn(sn_t *S, int argc, obj_t **argv)
+{
+  builtin_pr(S, argc, argv);
+  fputc('\n', stdout);
   return S->NIL;
 }
 
+static obj_t *
+builtin_save_image(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *path = argv[0];
+  char name[4096];
+
+  if (!FLAG_P(path, ATOM_T) || path->atom.flag != STRING_T
+      || path->atom.string.length >= sizeof(name)) {
+    fprintf(stderr, "TYPE_ERROR: save-image requires a file name\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(name, path->atom.string.data, path->atom.string.length);
+  name[path->atom.string.length] = '\0';
+
+  if (image_save(S, name) != 0) {
+    perror(name);
+    return S->NIL;
+  }
+  return S->TRUE;
+}
+
+#ifdef VM_PROFILE
+/* Prints the opcode profile so far, and starts a new one with :reset */
+static obj_t *
+builtin_vm_profile(sn_t *S, int argc, obj_t **argv)
+{
+  vm_profile_dump(S, stdout);
+  if (argc == 1) {
+    if (!FLAG_P(argv[0], ATOM_T) || argv[0]->atom.flag != KEYWORD_T
+        || strcmp(argv[0]->atom.string.data, ":reset") != 0) {
+      fprintf(stderr, "TYPE_ERROR: vm-profile only takes :reset\n");
+      exit(EXIT_FAILURE);
+    }
+    vm_profile_reset(S);
+  }
+  return S->NIL;
+}
+#endif
+
+#ifdef ALLOC_PROFILE
+/* Prints the allocation profile so far, and starts a new one with :reset */
+static obj_t *
+builtin_alloc_profile(sn_t *S, int argc, obj_t **argv)
+{
+  alloc_profile_dump(S, stdout);
+  if (argc == 1) {
+    if (!FLAG_P(argv[0], ATOM_T) || argv[0]->atom.flag != KEYWORD_T
+        || strcmp(argv[0]->atom.string.data, ":reset") != 0) {
+      fprintf(stderr, "TYPE_ERROR: alloc-profile only takes :reset\n");
+      exit(EXIT_FAILURE);
+    }
+    alloc_profile_reset(S);
+  }
+  return S->NIL;
+}
+#endif
 
 static module_entry_t builtins[] = {
-  { "cons", builtin_cons, 1, 2 },
+  { "cons", builtin_cons, 2, 2 },
   { "list", builtin_list, 0, -1 },
   { "nil?", builtin_nil_p, 1, 1 },
 
@@ -159,14 +536,30 @@ static module_entry_t builtins[] = {
 
   { "module-set!", builtin_module_set_b, 2, 2 },
 
+  { "pr-str", builtin_pr_str, 1, 1 },
+  { "pr", builtin_pr, 0, -1 },
+  { "prn", builtin_prn, 0, -1 },
+  { "save-image", builtin_save_image, 1, 1 },
+#ifdef VM_PROFILE
+  { "vm-profile", builtin_vm_profile, 0, 1 },
+#endif
+#ifdef ALLOC_PROFILE
+  { "alloc-profile", builtin_alloc_profile, 0, 1 },
+#endif
+
   /* { "length", builtin_length, 1, 1 }, */
 
-  /* { "+", builtin_plus, 1, -1 }, */
-  /* { "-", builtin_minus, 1, -1 }, */
-  /* { "*", builtin_multiply, 1, -1 }, */
-  /* { "/", builtin_divide, 1, -1 }, */
-  /* { "%", builtin_mod, 1, -1 }, */
-  /* { NULL, NULL, 0, 0 } */
+  { "+", builtin_add, 0, -1 },
+  { "-", builtin_subtract, 1, -1 },
+  { "*", builtin_multiply, 0, -1 },
+  { "/", builtin_divide, 1, -1 },
+  { "%", builtin_mod, 2, 2 },
+  { "=", builtin_num_eq, 1, -1 },
+  { "<", builtin_lt, 1, -1 },
+  { ">", builtin_gt, 1, -1 },
+  { "<=", builtin_le, 1, -1 },
+  { ">=", builtin_ge, 1, -1 },
+  { NULL, NULL, 0, 0 }
 };
 
 void
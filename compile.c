@@ -0,0 +1,353 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "lll.h"
+
+/**
+ * The bytecode compiler.
+ *
+ * Every fn form, and every expression handed to eval, is compiled into
+ * a CODE_T object holding a vector of constants followed by a vector
+ * of instruction words. Each instruction is an opcode_t followed by its
+ * operands; see lll.h for what they do.
+ *
+ * Symbols that name a parameter of an enclosing fn are resolved here to
+ * a frame depth and slot index (the scope is a list of parameter lists,
+ * innermost first), so at runtime a local is a fixed number of pointer
+ * hops away. Everything else is looked up as a global.
+ *
+ * Calls in tail position are compiled to OP_TAIL_CALL, and every other
+ * path through a body ends in OP_RETURN.
+ *
+ * Evaluating an expression always leaves Args as it found it, so a
+ * call to a global doesn't need an OP_FRAME: its arguments are pushed
+ * onto whatever Args holds, and OP_CALL_GLOBAL takes the newest n.
+ * A body that makes no closures can't have its frame captured, so its
+ * tail calls to globals become OP_TAIL_CALL_SELF, which overwrites the
+ * frame in place when the callee turns out to be the same code.
+ */
+
+typedef struct compiler {
+  int *insns;
+  int length;
+  int alloc;
+  obj_t *consts;  /* newest first, so the index of the head is nconsts - 1 */
+  int nconsts;
+  int closures;   /* number of OP_CLOSUREs emitted */
+} compiler_t;
+
+/* Number of operands of each opcode_t */
+static const int operands[OP_COUNT] = {
+  1, 2, 1, 1, 0, 0, 1, 1, 1, 1, 0, 0,
+  2, 3, 2, 2, 2
+};
+
+static void compile_exp(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope,
+                        int tail);
+
+static void
+emit(compiler_t *c, int word)
+{
+  if (c->length >= c->alloc) {
+    c->alloc = c->alloc ? c->alloc * 2 : CODE_INIT_SIZE;
+    c->insns = realloc(c->insns, sizeof(*c->insns) * c->alloc);
+    if (c->insns == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  c->insns[c->length++] = word;
+}
+
+static int
+add_const(sn_t *S, compiler_t *c, obj_t *o)
+{
+  c->consts = cons(S, o, c->consts);
+  return c->nconsts++;
+}
+
+static int
+is_symbol(obj_t *o)
+{
+  return FLAG_P(o, ATOM_T) && o->atom.flag == SYMBOL_T;
+}
+
+static int
+scope_lookup(sn_t *S, obj_t *scope, obj_t *sym, int *depth, int *index)
+{
+  obj_t *names;
+  int d, i;
+
+  for (d = 0; scope != S->NIL; d++, scope = cdr(S, scope)) {
+    names = car(S, scope);
+    for (i = 0; FLAG_P(names, CONS_T); i++, names = cdr(S, names)) {
+      if (car(S, names) == sym) {
+        *depth = d;
+        *index = i;
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static obj_t *
+mk_code(sn_t *S, compiler_t *c, obj_t *params, int arity)
+{
+  obj_t *o, *consts, **slot;
+  size_t size;
+  int i;
+
+  size = sizeof(*o) + GC_ALIGN(c->nconsts * sizeof(obj_t *)
+                               + c->length * sizeof(int));
+  GC_PROTECT(S, params);
+  o = gc_alloc(S, size);
+  GC_UNPROTECT(S, 1);
+  ALLOC_PROFILE_COUNT(S, ALLOC_CODE, size);
+
+  o->flag = CODE_T;
+  o->code.params = params;
+  o->code.arity = arity;
+  o->code.nconsts = c->nconsts;
+  o->code.length = c->length;
+  o->code.site = 0;
+
+  slot = CODE_CONSTS(o);
+  for (i = c->nconsts - 1, consts = c->consts; i >= 0; i--) {
+    slot[i] = consts->cons.car;
+    consts = consts->cons.cdr;
+  }
+  memcpy(CODE_INSNS(o), c->insns, c->length * sizeof(int));
+
+  return o;
+}
+
+/* `scope` already includes `params` */
+static obj_t *
+compile_code(sn_t *S, obj_t *params, int arity, obj_t *body, obj_t *scope)
+{
+  compiler_t c;
+  obj_t *code;
+  int i;
+
+  c.insns = NULL;
+  c.length = 0;
+  c.alloc = 0;
+  c.consts = S->NIL;
+  c.nconsts = 0;
+  c.closures = 0;
+
+  GC_PROTECT(S, params);
+  GC_PROTECT(S, body);
+  GC_PROTECT(S, scope);
+  GC_PROTECT(S, c.consts);
+
+  if (body == S->NIL) {
+    compile_exp(S, &c, S->NIL, scope, 1);
+  }
+  for (; FLAG_P(body, CONS_T); body = cdr(S, body)) {
+    compile_exp(S, &c, car(S, body), scope, cdr(S, body) == S->NIL);
+  }
+
+  if (c.closures == 0) {
+    for (i = 0; i < c.length; i += 1 + operands[c.insns[i]]) {
+      if (c.insns[i] == OP_TAIL_CALL_GLOBAL) {
+        c.insns[i] = OP_TAIL_CALL_SELF;
+      }
+    }
+  }
+
+  code = mk_code(S, &c, params, arity);
+  GC_UNPROTECT(S, 4);
+  free(c.insns);
+
+  return code;
+}
+
+static void
+compile_if(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope, int tail)
+{
+  int else_at, end_at = 0, depth, index;
+
+  exp = cdr(S, exp);
+  if (!FLAG_P(exp, CONS_T)) {
+    fprintf(stderr, "FATAL: Syntax error at 'if'\n");
+    exit(1);
+  }
+
+  GC_PROTECT(S, exp);
+  GC_PROTECT(S, scope);
+
+  if (is_symbol(car(S, exp))
+      && scope_lookup(S, scope, car(S, exp), &depth, &index)) {
+    emit(c, OP_JUMP_UNLESS_LOCAL);
+    emit(c, depth);
+    emit(c, index);
+  }
+  else {
+    compile_exp(S, c, car(S, exp), scope, 0);
+    emit(c, OP_JUMP_IF_FALSE);
+  }
+  else_at = c->length;
+  emit(c, 0);
+
+  compile_exp(S, c, car(S, cdr(S, exp)), scope, tail);
+  if (!tail) {
+    emit(c, OP_JUMP);
+    end_at = c->length;
+    emit(c, 0);
+  }
+
+  c->insns[else_at] = c->length;
+  compile_exp(S, c, car(S, cdr(S, cdr(S, exp))), scope, tail);
+  if (!tail) {
+    c->insns[end_at] = c->length;
+  }
+
+  GC_UNPROTECT(S, 2);
+}
+
+static void
+compile_fn(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope)
+{
+  obj_t *params, *code;
+  int arity = 0;
+
+  exp = cdr(S, exp);
+  if (!FLAG_P(exp, CONS_T)) {
+    fprintf(stderr, "FATAL: Syntax error in fn declaration\n");
+    exit(1);
+  }
+
+  for (params = car(S, exp); FLAG_P(params, CONS_T); params = cdr(S, params)) {
+    if (!is_symbol(car(S, params))) {
+      fprintf(stderr, "FATAL: Syntax error in fn parameter list\n");
+      exit(1);
+    }
+    arity++;
+  }
+  if (params != S->NIL) {
+    fprintf(stderr, "FATAL: Syntax error in fn declaration\n");
+    exit(1);
+  }
+
+  GC_PROTECT(S, exp);
+  scope = cons(S, car(S, exp), scope);
+  code = compile_code(S, car(S, exp), arity, cdr(S, exp), scope);
+  GC_UNPROTECT(S, 1);
+
+  emit(c, OP_CLOSURE);
+  emit(c, add_const(S, c, code));
+  c->closures++;
+}
+
+static void
+compile_arg(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope)
+{
+  int depth, index;
+
+  if (is_symbol(exp) && scope_lookup(S, scope, exp, &depth, &index)) {
+    emit(c, OP_ARG_LOCAL);
+    emit(c, depth);
+    emit(c, index);
+  }
+  else {
+    compile_exp(S, c, exp, scope, 0);
+    emit(c, OP_ARG);
+  }
+}
+
+static void
+compile_call(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope, int tail)
+{
+  obj_t *args;
+  int n = 0, global, depth, index;
+
+  GC_PROTECT(S, exp);
+  GC_PROTECT(S, scope);
+
+  global = is_symbol(car(S, exp))
+    && !scope_lookup(S, scope, car(S, exp), &depth, &index);
+  if (!global) {
+    compile_exp(S, c, car(S, exp), scope, 0);
+    emit(c, OP_FRAME);
+  }
+
+  args = cdr(S, exp);
+  GC_PROTECT(S, args);
+  for (; FLAG_P(args, CONS_T); args = cdr(S, args)) {
+    compile_arg(S, c, car(S, args), scope);
+    n++;
+  }
+
+  if (global) {
+    emit(c, tail ? OP_TAIL_CALL_GLOBAL : OP_CALL_GLOBAL);
+    emit(c, add_const(S, c, car(S, exp)));
+  }
+  else {
+    emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+  }
+  emit(c, n);
+
+  GC_UNPROTECT(S, 3);
+}
+
+static void
+compile_exp(sn_t *S, compiler_t *c, obj_t *exp, obj_t *scope, int tail)
+{
+  obj_t *head;
+  int depth, index;
+
+  if (is_symbol(exp)) {
+    if (scope_lookup(S, scope, exp, &depth, &index)) {
+      emit(c, OP_LOCAL);
+      emit(c, depth);
+      emit(c, index);
+    }
+    else {
+      emit(c, OP_GLOBAL);
+      emit(c, add_const(S, c, exp));
+    }
+  }
+  else if (!FLAG_P(exp, CONS_T)) {
+    emit(c, OP_CONST);
+    emit(c, add_const(S, c, exp));
+  }
+  else if ((head = car(S, exp)) == S->QUOTE) {
+    emit(c, OP_CONST);
+    emit(c, add_const(S, c, car(S, cdr(S, exp))));
+  }
+  else if (head == S->IF) {
+    compile_if(S, c, exp, scope, tail);
+    return;
+  }
+  else if (head == S->FN) {
+    compile_fn(S, c, exp, scope);
+  }
+  else {
+    compile_call(S, c, exp, scope, tail);
+    return;
+  }
+
+  if (tail) {
+    emit(c, OP_RETURN);
+  }
+}
+
+/**
+ * Compiles `exp` for evaluation in an environment whose parameter
+ * lists are `scope`, as built by env_scope.
+ */
+obj_t *
+compile(sn_t *S, obj_t *exp, obj_t *scope)
+{
+  obj_t *code;
+
+  GC_PROTECT(S, scope);
+  exp = cons(S, exp, S->NIL);
+  code = compile_code(S, S->NIL, 0, exp, scope);
+  GC_UNPROTECT(S, 1);
+
+  return code;
+}
@@ -0,0 +1,523 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "lll.h"
+
+/**
+ * A generational copying collector over a chunked heap.
+ *
+ * New objects are bump-allocated from the nursery, a single
+ * HEAP_CHUNK_SIZE chunk. When it fills up, a minor collection copies
+ * whatever is reachable from the sn_t registers, the symbol table, the
+ * global values, the protect stack, the evaluator's stack and the
+ * remembered set into the old space, and the nursery starts over empty.
+ *
+ * The old space is a list of chunks of the same size. Once
+ * Heap_threshold bytes of them have been handed out, the next
+ * collection is a major one instead: a Cheney-style copy of everything
+ * live, old and young, into a fresh set of chunks. The evacuated chunks
+ * go onto Heap_free to be reused.
+ *
+ * Chunks are aligned to their size so the chunk (and therefore the
+ * space) an object belongs to can be found by masking its address.
+ *
+ * C code that holds on to an obj_t * across a call that may allocate
+ * has to register the variable with GC_PROTECT first, since collection
+ * moves objects. Code that stores into an existing object has to call
+ * GC_WRITE on it, so that old objects pointing into the nursery are
+ * treated as roots by the next minor collection.
+ */
+
+struct chunk {
+  chunk_t *next;
+  char *top;  /* end of the allocated part, once retired */
+  char *end;
+  int space;
+};
+
+#define NURSERY_SPACE 2
+
+#define CHUNK_HEADER GC_ALIGN(sizeof(chunk_t))
+#define CHUNK_OF(o) ((chunk_t *)((uintptr_t)(o) & ~(uintptr_t)(HEAP_CHUNK_SIZE - 1)))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEADER)
+
+/* Largest object that is allocated in the nursery */
+#define NURSERY_MAX_OBJECT (HEAP_CHUNK_SIZE / 8)
+
+size_t
+obj_size(obj_t *o)
+{
+  if (o->flag == ATOM_T && o->atom.flag == STRING_T) {
+    if (o->atom.slice) {
+      return sizeof(*o) + sizeof(obj_t *);
+    }
+    return sizeof(*o) + GC_ALIGN(o->atom.string.length + 1);
+  }
+  else if (o->flag == FRAME_T) {
+    return sizeof(*o) + GC_ALIGN(o->frame.length * sizeof(obj_t *));
+  }
+  else if (o->flag == VECTOR_T) {
+    return sizeof(*o) + GC_ALIGN(o->vector.length * sizeof(int64_t));
+  }
+  else if (o->flag == CODE_T) {
+    return sizeof(*o) + GC_ALIGN(o->code.nconsts * sizeof(obj_t *)
+                                 + o->code.length * sizeof(int));
+  }
+  return sizeof(*o);
+}
+
+static size_t
+chunk_size(chunk_t *c)
+{
+  return c->end - (char *)c;
+}
+
+static chunk_t *
+chunk_alloc(sn_t *S, size_t size)
+{
+  chunk_t *c;
+
+  if (size == HEAP_CHUNK_SIZE && S->Heap_free != NULL) {
+    c = S->Heap_free;
+    S->Heap_free = c->next;
+    S->Heap_free_size -= HEAP_CHUNK_SIZE;
+  }
+  else if (posix_memalign((void **)&c, HEAP_CHUNK_SIZE, size) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+
+  c->next = NULL;
+  c->end = (char *)c + size;
+  c->top = c->end;
+  return c;
+}
+
+static void
+chunk_release(sn_t *S, chunk_t *c)
+{
+  if (chunk_size(c) == HEAP_CHUNK_SIZE
+      && S->Heap_free_size + HEAP_CHUNK_SIZE <= S->Heap_threshold) {
+    c->space = -1;
+    c->next = S->Heap_free;
+    S->Heap_free = c;
+    S->Heap_free_size += HEAP_CHUNK_SIZE;
+  }
+  else {
+    free(c);
+  }
+}
+
+/**
+ * Retires the current old space chunk and starts bump-allocating from
+ * a new one with room for at least `need` bytes. Objects larger than a
+ * chunk get one of their own.
+ */
+static void
+chunk_next(sn_t *S, size_t need)
+{
+  chunk_t *c;
+  size_t size = HEAP_CHUNK_SIZE;
+
+  if (need > HEAP_CHUNK_SIZE - CHUNK_HEADER) {
+    size = GC_ALIGN(need + CHUNK_HEADER);
+  }
+
+  c = chunk_alloc(S, size);
+  c->space = S->Heap_space;
+
+  if (S->Heap_chunk != NULL) {
+    S->Heap_chunk->top = S->Old_next;
+    S->Heap_chunk->next = c;
+  }
+  else {
+    S->Heap = c;
+  }
+  S->Heap_chunk = c;
+  S->Old_next = CHUNK_DATA(c);
+  S->Old_limit = c->end;
+  S->Heap_allocated += size;
+}
+
+static void *
+old_alloc(sn_t *S, size_t size)
+{
+  char *p;
+
+  if (S->Old_next + size > S->Old_limit) {
+    chunk_next(S, size);
+  }
+  p = S->Old_next;
+  S->Old_next += size;
+  return p;
+}
+
+static obj_t *
+gc_forward(sn_t *S, obj_t *o, int minor)
+{
+  obj_t *n;
+  size_t size;
+
+  if (o == NULL || IMMEDIATE_P(o)) {
+    return o;
+  }
+  if (minor ? !GC_YOUNG(S, o)
+      : GC_IMAGE(S, o) || CHUNK_OF(o)->space == S->Heap_space) {
+    return o;
+  }
+
+  if (o->flag == FORWARD_T) {
+    return o->cons.car;
+  }
+
+  size = obj_size(o);
+  n = old_alloc(S, size);
+  memcpy(n, o, size);
+  n->gcflags = 0;
+
+  /* string bytes are stored inline, right after the object */
+  if (n->flag == ATOM_T && n->atom.flag == STRING_T && !n->atom.slice) {
+    n->atom.string.data = (char *)(n + 1);
+  }
+
+  o->flag = FORWARD_T;
+  o->cons.car = n;
+
+  return n;
+}
+
+static void
+gc_scan_object(sn_t *S, obj_t *o, int minor)
+{
+  obj_t **slot, *parent;
+  int i;
+
+  switch (o->flag) {
+  case ATOM_T:
+    /* keep a slice pointing at the same offset into its parent */
+    if (o->atom.flag == STRING_T && o->atom.slice) {
+      parent = STRING_PARENT(o);
+      STRING_PARENT(o) = gc_forward(S, parent, minor);
+      o->atom.string.data = (char *)(STRING_PARENT(o) + 1)
+        + (o->atom.string.data - (char *)(parent + 1));
+    }
+    break;
+  case CONS_T:
+    o->cons.car = gc_forward(S, o->cons.car, minor);
+    o->cons.cdr = gc_forward(S, o->cons.cdr, minor);
+    break;
+  case CLOS_T:
+    o->clos.code = gc_forward(S, o->clos.code, minor);
+    o->clos.env = gc_forward(S, o->clos.env, minor);
+    break;
+  case FRAME_T:
+    o->frame.up = gc_forward(S, o->frame.up, minor);
+    o->frame.names = gc_forward(S, o->frame.names, minor);
+    slot = FRAME_SLOTS(o);
+    for (i = 0; i < o->frame.length; i++) {
+      slot[i] = gc_forward(S, slot[i], minor);
+    }
+    break;
+  case BUILDER_T:
+    o->builder.bytes = gc_forward(S, o->builder.bytes, minor);
+    break;
+  case HASH_T:
+    o->hash.table = gc_forward(S, o->hash.table, minor);
+    o->hash.old = gc_forward(S, o->hash.old, minor);
+    break;
+  case CODE_T:
+    o->code.params = gc_forward(S, o->code.params, minor);
+    slot = CODE_CONSTS(o);
+    for (i = 0; i < o->code.nconsts; i++) {
+      slot[i] = gc_forward(S, slot[i], minor);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+gc_roots(sn_t *S, int minor)
+{
+  int i;
+
+  S->NIL = gc_forward(S, S->NIL, minor);
+  S->Env = gc_forward(S, S->Env, minor);
+  S->Exp = gc_forward(S, S->Exp, minor);
+  S->Code = gc_forward(S, S->Code, minor);
+  S->Val = gc_forward(S, S->Val, minor);
+  S->FN = gc_forward(S, S->FN, minor);
+  S->IF = gc_forward(S, S->IF, minor);
+  S->QUOTE = gc_forward(S, S->QUOTE, minor);
+  S->TRUE = gc_forward(S, S->TRUE, minor);
+
+  for (i = 0; i < S->Symtab_alloc; i++) {
+    S->Symtab[i] = gc_forward(S, S->Symtab[i], minor);
+  }
+
+  for (i = 1; i < S->Globals_index; i++) {
+    S->Globals[i] = gc_forward(S, S->Globals[i], minor);
+  }
+
+  for (i = 0; i < S->Roots_index; i++) {
+    *S->Roots[i] = gc_forward(S, *S->Roots[i], minor);
+  }
+
+  for (i = 0; i < S->Stack_index; i++) {
+    S->Stack[i].code = gc_forward(S, S->Stack[i].code, minor);
+    S->Stack[i].env = gc_forward(S, S->Stack[i].env, minor);
+    S->Stack[i].fn = gc_forward(S, S->Stack[i].fn, minor);
+  }
+
+  for (i = 0; i < S->Args_index; i++) {
+    S->Args[i] = gc_forward(S, S->Args[i], minor);
+  }
+}
+
+/**
+ * Cheney scan of the old space from `scan` in chunk `c` onwards. The
+ * chunk being filled has no top yet, so it is re-checked every step.
+ */
+static void
+gc_scan(sn_t *S, chunk_t *c, char *scan, int minor)
+{
+  obj_t *o;
+
+  for (;;) {
+    while (scan < (c == S->Heap_chunk ? S->Old_next : c->top)) {
+      o = (obj_t *)scan;
+      gc_scan_object(S, o, minor);
+      scan += obj_size(o);
+    }
+    if (c->next == NULL) {
+      break;
+    }
+    c = c->next;
+    scan = CHUNK_DATA(c);
+  }
+}
+
+static void
+gc_forget(sn_t *S)
+{
+  int i;
+  for (i = 0; i < S->Remembered_index; i++) {
+    S->Remembered[i]->gcflags &= ~GC_REMEMBERED;
+  }
+  S->Remembered_index = 0;
+  S->Remembered_slots_index = 0;
+}
+
+static void
+gc_minor(sn_t *S)
+{
+  chunk_t *c = S->Heap_chunk;
+  char *scan = S->Old_next;
+  int i;
+
+  S->Gc_allocated += S->Heap_next - CHUNK_DATA(S->Nursery);
+  S->Gc_minors++;
+
+  gc_roots(S, 1);
+  for (i = 0; i < S->Remembered_index; i++) {
+    gc_scan_object(S, S->Remembered[i], 1);
+  }
+  for (i = 0; i < S->Remembered_slots_index; i++) {
+    *S->Remembered_slots[i] = gc_forward(S, *S->Remembered_slots[i], 1);
+  }
+  gc_forget(S);
+
+  gc_scan(S, c, scan, 1);
+
+  S->Heap_next = CHUNK_DATA(S->Nursery);
+}
+
+static void
+gc_major(sn_t *S)
+{
+  chunk_t *from, *c;
+  char *scan;
+  obj_t *o;
+
+  S->Gc_allocated += S->Heap_next - CHUNK_DATA(S->Nursery);
+  S->Gc_majors++;
+
+  from = S->Heap;
+  S->Heap = NULL;
+  S->Heap_chunk = NULL;
+  S->Heap_allocated = 0;
+  S->Heap_space = !S->Heap_space;
+  chunk_next(S, 0);
+
+  /* everything gets copied, so the remembered set is moot */
+  gc_forget(S);
+
+  gc_roots(S, 0);
+
+  /* objects loaded from an image stay put, but may point anywhere */
+  for (scan = S->Image; scan < S->Image_end; scan += obj_size(o)) {
+    o = (obj_t *)scan;
+    gc_scan_object(S, o, 0);
+  }
+
+  gc_scan(S, S->Heap, CHUNK_DATA(S->Heap), 0);
+
+  /* survivors get as much room again before the next collection */
+  S->Heap_threshold = S->Heap_allocated * 2;
+  if (S->Heap_threshold < HEAP_INIT_SIZE) {
+    S->Heap_threshold = HEAP_INIT_SIZE;
+  }
+
+  while (from != NULL) {
+    c = from->next;
+    chunk_release(S, from);
+    from = c;
+  }
+
+  S->Heap_next = CHUNK_DATA(S->Nursery);
+}
+
+void
+gc_collect(sn_t *S)
+{
+  if (S->Heap_allocated >= S->Heap_threshold) {
+    gc_major(S);
+  }
+  else {
+    gc_minor(S);
+  }
+}
+
+void
+gc_init(sn_t *S)
+{
+  S->Heap = NULL;
+  S->Heap_chunk = NULL;
+  S->Heap_free = NULL;
+  S->Heap_free_size = 0;
+  S->Heap_allocated = 0;
+  S->Heap_threshold = HEAP_INIT_SIZE;
+  S->Heap_space = 0;
+  S->Gc_allocated = 0;
+  S->Gc_minors = 0;
+  S->Gc_majors = 0;
+  chunk_next(S, 0);
+
+  S->Nursery = chunk_alloc(S, HEAP_CHUNK_SIZE);
+  S->Nursery->space = NURSERY_SPACE;
+  S->Heap_next = CHUNK_DATA(S->Nursery);
+  S->Heap_limit = S->Nursery->end;
+
+  S->Roots = malloc(sizeof(*S->Roots) * ROOTS_INIT_SIZE);
+  S->Remembered = malloc(sizeof(*S->Remembered) * ROOTS_INIT_SIZE);
+  S->Remembered_slots = malloc(sizeof(*S->Remembered_slots) * ROOTS_INIT_SIZE);
+  if (S->Roots == NULL || S->Remembered == NULL
+      || S->Remembered_slots == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  S->Roots_alloc = ROOTS_INIT_SIZE;
+  S->Roots_index = 0;
+  S->Remembered_alloc = ROOTS_INIT_SIZE;
+  S->Remembered_index = 0;
+  S->Remembered_slots_alloc = ROOTS_INIT_SIZE;
+  S->Remembered_slots_index = 0;
+}
+
+/**
+ * The slow path of GC_ALLOC: empties the nursery so that the next
+ * small allocation fits. Everything not reachable from a root may move.
+ */
+void
+gc_reserve(sn_t *S, size_t size)
+{
+#ifdef GC_STRESS
+  static int minors = 0;
+  if (++minors % 64 == 0) {
+    gc_major(S);
+    return;
+  }
+#endif
+  gc_collect(S);
+}
+
+void *
+gc_alloc(sn_t *S, size_t size)
+{
+  obj_t *o;
+
+  if (GC_ROOM(S, size)) {
+    return GC_BUMP(S, size);
+  }
+
+  /* big objects go straight to the old space, and are remembered
+     since their fields may be filled in with young objects */
+  if (size > NURSERY_MAX_OBJECT) {
+    if (S->Heap_allocated >= S->Heap_threshold) {
+      gc_major(S);
+    }
+    o = old_alloc(S, size);
+    S->Gc_allocated += size;
+    o->gcflags = 0;
+    gc_remember(S, o);
+    return o;
+  }
+
+  gc_reserve(S, size);
+  return GC_BUMP(S, size);
+}
+
+/* Bytes allocated so far, including what has since been collected */
+size_t
+gc_allocated(sn_t *S)
+{
+  return S->Gc_allocated + (S->Heap_next - CHUNK_DATA(S->Nursery));
+}
+
+void
+gc_remember(sn_t *S, obj_t *o)
+{
+  if (S->Remembered_index >= S->Remembered_alloc) {
+    S->Remembered_alloc *= 2;
+    S->Remembered = realloc(S->Remembered,
+                            sizeof(*S->Remembered) * S->Remembered_alloc);
+    if (S->Remembered == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  o->gcflags |= GC_REMEMBERED;
+  S->Remembered[S->Remembered_index++] = o;
+}
+
+/* A slot may be remembered more than once; forwarding it again is harmless */
+void
+gc_remember_slot(sn_t *S, obj_t **slot)
+{
+  if (S->Remembered_slots_index >= S->Remembered_slots_alloc) {
+    S->Remembered_slots_alloc *= 2;
+    S->Remembered_slots = realloc(S->Remembered_slots,
+                                  sizeof(*S->Remembered_slots)
+                                  * S->Remembered_slots_alloc);
+    if (S->Remembered_slots == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  S->Remembered_slots[S->Remembered_slots_index++] = slot;
+}
+
+void
+gc_protect(sn_t *S, obj_t **root)
+{
+  if (S->Roots_index >= S->Roots_alloc) {
+    S->Roots_alloc *= 2;
+    S->Roots = realloc(S->Roots, sizeof(*S->Roots) * S->Roots_alloc);
+    if (S->Roots == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  S->Roots[S->Roots_index++] = root;
+}
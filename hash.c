@@ -0,0 +1,410 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include "lll.h"
+
+/**
+ * Hash maps keyed by symbols, keywords, fixnums and strings.
+ *
+ * A HASH_T points at a table of key, value pairs, probed linearly and
+ * kept at most half full. An empty slot has NIL as its key, so NIL
+ * can't be a key, though it can be a value. Removing a pair shifts the
+ * rest of its run back, so the table never holds tombstones.
+ *
+ * Growing doesn't rehash everything at once. The full table becomes
+ * `old`, and each later put or delete moves the next HASH_MOVE_STEP
+ * pairs of it into a table twice the size. Lookups try the new table,
+ * then the old one. A moved or deleted pair of the old table leaves
+ * IMM_DELETED as its key, which keeps the runs after it intact, so a
+ * key is only ever in one of the two. The new table is full again
+ * after another old capacity / 2 puts, long after the old one has been
+ * emptied.
+ *
+ * Stores into a table go through GC_WRITE_SLOT, so a big table in the
+ * old space doesn't have to be scanned whole by every minor collection.
+ * Storing NIL or IMM_DELETED needs no barrier at all.
+ *
+ * Symbols and keywords are interned, so they compare by identity.
+ * They hash by name, like strings, since the collector moves them.
+ */
+
+#define HASH_MIN 8        /* pairs in the smallest table */
+#define HASH_MAX (1 << 29) /* pairs in the largest, as frame lengths are ints */
+#define HASH_MOVE_STEP 8
+
+#define CAPACITY(t) ((t)->frame.length / 2)
+#define KEY(t, i) (FRAME_SLOTS(t)[2 * (i)])
+#define VALUE(t, i) (FRAME_SLOTS(t)[2 * (i) + 1])
+
+enum { HASH_KEYS, HASH_VALUES, HASH_PAIRS };
+
+static size_t
+hash_key(obj_t *key, const char *name)
+{
+  size_t h;
+
+  if (FIXNUM_P(key)) {
+    h = (size_t)FIXNUM_VAL(key);
+  }
+  else if (FLAG_P(key, ATOM_T) && key->atom.flag == FIXNUM_T) {
+    h = (size_t)key->atom.fixnum;
+  }
+  else if (FLAG_P(key, ATOM_T) && key->atom.flag != FLONUM_T) {
+    return string_hash(key->atom.string.data, key->atom.string.length);
+  }
+  else {
+    fprintf(stderr, "TYPE_ERROR: %s requires a symbol, keyword, fixnum "
+            "or string key\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  /* spread strided integers over the low bits */
+  h *= (size_t)0x9e3779b97f4a7c15ull;
+  return h ^ (h >> (sizeof(h) * 4));
+}
+
+static int
+hash_equal(obj_t *a, obj_t *b)
+{
+  if (a == b) {
+    return 1;
+  }
+  else if (IMMEDIATE_P(a) || IMMEDIATE_P(b) || a->atom.flag != b->atom.flag) {
+    return 0;
+  }
+  else if (a->atom.flag == FIXNUM_T) {
+    return a->atom.fixnum == b->atom.fixnum;
+  }
+  else if (a->atom.flag == STRING_T) {
+    return a->atom.string.length == b->atom.string.length
+      && memcmp(a->atom.string.data, b->atom.string.data,
+                a->atom.string.length) == 0;
+  }
+  return 0;
+}
+
+/* The pair of `key` in table `t`, or -1 */
+static long
+hash_find(sn_t *S, obj_t *t, obj_t *key, size_t h)
+{
+  long i, mask = CAPACITY(t) - 1;
+  obj_t *k;
+
+  for (i = h & mask; (k = KEY(t, i)) != S->NIL; i = (i + 1) & mask) {
+    if (hash_equal(k, key)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Finds the pair of `key` in either table of `m`, and sets *table */
+static long
+hash_lookup(sn_t *S, obj_t *m, obj_t *key, size_t h, obj_t **table)
+{
+  long i;
+
+  *table = m->hash.table;
+  if ((i = hash_find(S, *table, key, h)) >= 0 || m->hash.old == S->NIL) {
+    return i;
+  }
+  *table = m->hash.old;
+  return hash_find(S, *table, key, h);
+}
+
+/* `key` isn't in `t` yet */
+static void
+hash_insert(sn_t *S, obj_t *t, obj_t *key, obj_t *value, size_t h)
+{
+  long i, mask = CAPACITY(t) - 1;
+
+  for (i = h & mask; KEY(t, i) != S->NIL; i = (i + 1) & mask) {
+  }
+  KEY(t, i) = key;
+  VALUE(t, i) = value;
+  GC_WRITE_SLOT(S, t, &KEY(t, i));
+  GC_WRITE_SLOT(S, t, &VALUE(t, i));
+}
+
+/* Empties pair i of `t`, moving back the pairs whose run crossed it */
+static void
+hash_remove(sn_t *S, obj_t *t, long i)
+{
+  long j = i, home, mask = CAPACITY(t) - 1;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (KEY(t, j) == S->NIL) {
+      break;
+    }
+    home = hash_key(KEY(t, j), NULL) & mask;
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+      continue;
+    }
+    KEY(t, i) = KEY(t, j);
+    VALUE(t, i) = VALUE(t, j);
+    GC_WRITE_SLOT(S, t, &KEY(t, i));
+    GC_WRITE_SLOT(S, t, &VALUE(t, i));
+    i = j;
+  }
+  KEY(t, i) = S->NIL;
+  VALUE(t, i) = S->NIL;
+}
+
+/* Moves up to `steps` pairs of the old table into the new one */
+static void
+hash_move(sn_t *S, obj_t *m, long steps)
+{
+  obj_t *old = m->hash.old, *k;
+  long i;
+
+  for (; steps > 0 && m->hash.moved < CAPACITY(old); steps--) {
+    i = m->hash.moved++;
+    if ((k = KEY(old, i)) != S->NIL && k != IMM_DELETED) {
+      hash_insert(S, m->hash.table, k, VALUE(old, i), hash_key(k, NULL));
+      KEY(old, i) = IMM_DELETED;
+      VALUE(old, i) = S->NIL;
+    }
+  }
+  if (m->hash.moved == CAPACITY(old)) {
+    m->hash.old = S->NIL;
+    m->hash.moved = 0;
+  }
+}
+
+/* Makes room for one more key */
+static obj_t *
+hash_grow(sn_t *S, obj_t *m)
+{
+  obj_t *t;
+
+  if (m->hash.old != S->NIL) {
+    hash_move(S, m, LONG_MAX);
+  }
+  if (CAPACITY(m->hash.table) >= HASH_MAX) {
+    fprintf(stderr, "FATAL: Hash map too large\n");
+    exit(1);
+  }
+
+  GC_PROTECT(S, m);
+  t = mk_frame(S, S->NIL, S->NIL, m->hash.table->frame.length * 2);
+  GC_UNPROTECT(S, 1);
+  m->hash.old = m->hash.table;
+  m->hash.table = t;
+  m->hash.moved = 0;
+  GC_WRITE(S, m);
+  return m;
+}
+
+static void
+hash_put(sn_t *S, obj_t *m, obj_t *key, obj_t *value)
+{
+  obj_t *t;
+  size_t h = hash_key(key, "hash-put!");
+  long i;
+
+  if (m->hash.old != S->NIL) {
+    hash_move(S, m, HASH_MOVE_STEP);
+  }
+  if ((i = hash_lookup(S, m, key, h, &t)) >= 0) {
+    VALUE(t, i) = value;
+    GC_WRITE_SLOT(S, t, &VALUE(t, i));
+    return;
+  }
+
+  if ((m->hash.count + 1) * 2 > CAPACITY(m->hash.table)) {
+    GC_PROTECT(S, key);
+    GC_PROTECT(S, value);
+    m = hash_grow(S, m);
+    GC_UNPROTECT(S, 2);
+  }
+  hash_insert(S, m->hash.table, key, value, h);
+  m->hash.count++;
+}
+
+static int
+hash_delete(sn_t *S, obj_t *m, obj_t *key)
+{
+  obj_t *t;
+  size_t h = hash_key(key, "hash-delete!");
+  long i;
+
+  if (m->hash.old != S->NIL) {
+    hash_move(S, m, HASH_MOVE_STEP);
+  }
+  if ((i = hash_lookup(S, m, key, h, &t)) < 0) {
+    return 0;
+  }
+
+  if (t == m->hash.old) {
+    KEY(t, i) = IMM_DELETED;
+    VALUE(t, i) = S->NIL;
+  }
+  else {
+    hash_remove(S, t, i);
+  }
+  m->hash.count--;
+  return 1;
+}
+
+/* The keys, values or (key value) pairs of `m`, in no particular order */
+static obj_t *
+hash_list(sn_t *S, obj_t *m, int what)
+{
+  obj_t *list = S->NIL, *t, *x;
+  int old;
+  long i;
+
+  GC_PROTECT(S, m);
+  GC_PROTECT(S, list);
+  for (old = 0; old < 2; old++) {
+    t = old ? m->hash.old : m->hash.table;
+    if (t == S->NIL) {
+      continue;
+    }
+    for (i = CAPACITY(t) - 1; i >= 0; i--) {
+      /* consing moves the table, so find it again each time */
+      t = old ? m->hash.old : m->hash.table;
+      if (KEY(t, i) == S->NIL || KEY(t, i) == IMM_DELETED) {
+        continue;
+      }
+      switch (what) {
+      case HASH_KEYS:
+        x = KEY(t, i);
+        break;
+      case HASH_VALUES:
+        x = VALUE(t, i);
+        break;
+      default:
+        x = cons(S, VALUE(t, i), S->NIL);
+        t = old ? m->hash.old : m->hash.table;
+        x = cons(S, KEY(t, i), x);
+        break;
+      }
+      list = cons(S, x, list);
+    }
+  }
+  GC_UNPROTECT(S, 2);
+  return list;
+}
+
+static void
+hash_check(obj_t *o, const char *name)
+{
+  if (!FLAG_P(o, HASH_T)) {
+    fprintf(stderr, "TYPE_ERROR: %s requires a hash map\n", name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* (hash-map [size]) is empty, with room for `size` keys */
+static obj_t *
+builtin_hash_map(sn_t *S, int argc, obj_t **argv)
+{
+  long n = 0, capacity = HASH_MIN;
+
+  if (argc == 1) {
+    if (!FIXNUM_P(argv[0]) || (n = FIXNUM_VAL(argv[0])) < 0
+        || n > HASH_MAX / 2) {
+      fprintf(stderr, "TYPE_ERROR: hash-map requires a size from 0 to %d\n",
+              HASH_MAX / 2);
+      exit(EXIT_FAILURE);
+    }
+  }
+  while (capacity < n * 2) {
+    capacity *= 2;
+  }
+  return mk_hash(S, (int)capacity);
+}
+
+/* (hash-get m key [default]) */
+static obj_t *
+builtin_hash_get(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *t;
+  long i;
+
+  hash_check(argv[0], "hash-get");
+  i = hash_lookup(S, argv[0], argv[1], hash_key(argv[1], "hash-get"), &t);
+  if (i >= 0) {
+    return VALUE(t, i);
+  }
+  return argc == 3 ? argv[2] : S->NIL;
+}
+
+static obj_t *
+builtin_hash_has_p(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *t;
+
+  hash_check(argv[0], "hash-has?");
+  if (hash_lookup(S, argv[0], argv[1], hash_key(argv[1], "hash-has?"),
+                  &t) >= 0) {
+    return S->TRUE;
+  }
+  return S->NIL;
+}
+
+static obj_t *
+builtin_hash_put_b(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash-put!");
+  hash_put(S, argv[0], argv[1], argv[2]);
+  return S->NIL;
+}
+
+/* :true if the key was there */
+static obj_t *
+builtin_hash_delete_b(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash-delete!");
+  return hash_delete(S, argv[0], argv[1]) ? S->TRUE : S->NIL;
+}
+
+static obj_t *
+builtin_hash_count(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash-count");
+  return MK_FIXNUM(argv[0]->hash.count);
+}
+
+static obj_t *
+builtin_hash_keys(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash-keys");
+  return hash_list(S, argv[0], HASH_KEYS);
+}
+
+static obj_t *
+builtin_hash_values(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash-values");
+  return hash_list(S, argv[0], HASH_VALUES);
+}
+
+static obj_t *
+builtin_hash_to_list(sn_t *S, int argc, obj_t **argv)
+{
+  hash_check(argv[0], "hash->list");
+  return hash_list(S, argv[0], HASH_PAIRS);
+}
+
+static module_entry_t hashes[] = {
+  { "hash-map", builtin_hash_map, 0, 1 },
+  { "hash-get", builtin_hash_get, 2, 3 },
+  { "hash-has?", builtin_hash_has_p, 2, 2 },
+  { "hash-put!", builtin_hash_put_b, 3, 3 },
+  { "hash-delete!", builtin_hash_delete_b, 2, 2 },
+  { "hash-count", builtin_hash_count, 1, 1 },
+  { "hash-keys", builtin_hash_keys, 1, 1 },
+  { "hash-values", builtin_hash_values, 1, 1 },
+  { "hash->list", builtin_hash_to_list, 1, 1 },
+  { NULL, NULL, 0, 0 }
+};
+
+void
+install_hashes(sn_t *S)
+{
+  module_install(S, "hashes", hashes);
+}
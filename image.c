@@ -0,0 +1,463 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lll.h"
+
+/**
+ * Heap images.
+ *
+ * image_save writes everything reachable from the symbol table, the
+ * globals and the special symbols to a file: a header, the objects,
+ * the symbol table and globals arrays, and the names of symbols and
+ * primitives. Pointers are written as offsets from the start of the
+ * file, which can't be mistaken for immediates or NULL. Primitives are
+ * written as the name they were installed under, since their functions
+ * may be elsewhere in the next process.
+ *
+ * image_load maps the file and adds its address to every pointer in
+ * place. The objects are then used where they lie: the collector
+ * doesn't move them, and scans them all on a major collection, since
+ * they may have been changed to point at newer objects.
+ */
+
+#define IMAGE_MAGIC "lllimg2"
+
+typedef struct image_header {
+  char magic[8];
+  sn_ptr_t word_size;
+  sn_ptr_t obj_size;
+  sn_ptr_t heap_off;
+  sn_ptr_t heap_size;
+  sn_ptr_t symtab_off;
+  sn_ptr_t symtab_alloc;
+  sn_ptr_t symtab_index;
+  sn_ptr_t globals_off;
+  sn_ptr_t globals_index;
+  sn_ptr_t names_off;
+  sn_ptr_t names_size;
+  sn_ptr_t fn, if_, quote, true_;
+} image_header_t;
+
+#define HEAP_OFF GC_ALIGN(sizeof(image_header_t))
+
+/* A growable byte buffer */
+typedef struct image_buf {
+  char *data;
+  size_t len;
+  size_t alloc;
+} image_buf_t;
+
+/* Object addresses already copied, and their offsets */
+typedef struct image_map {
+  obj_t **keys;
+  sn_ptr_t *offs;
+  size_t alloc;
+  size_t count;
+} image_map_t;
+
+typedef struct image_writer {
+  image_buf_t heap;
+  image_buf_t names;
+  image_map_t map;
+} image_writer_t;
+
+static void
+buf_reserve(image_buf_t *b, size_t n)
+{
+  if (b->len + n <= b->alloc) {
+    return;
+  }
+  while (b->alloc < b->len + n) {
+    b->alloc = b->alloc ? b->alloc * 2 : HEAP_CHUNK_SIZE;
+  }
+  b->data = realloc(b->data, b->alloc);
+  if (b->data == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+}
+
+static size_t
+buf_put(image_buf_t *b, const void *p, size_t n)
+{
+  size_t at = b->len;
+
+  buf_reserve(b, n);
+  memcpy(b->data + at, p, n);
+  b->len += n;
+  return at;
+}
+
+static size_t
+map_slot(image_map_t *m, obj_t *o)
+{
+  size_t i = ((sn_ptr_t)o >> 3) * 2654435761u;
+
+  for (i &= m->alloc - 1; m->keys[i] != NULL && m->keys[i] != o;
+       i = (i + 1) & (m->alloc - 1))
+    ;
+  return i;
+}
+
+static void
+map_grow(image_map_t *m)
+{
+  obj_t **keys = m->keys;
+  sn_ptr_t *offs = m->offs;
+  size_t i, j, alloc = m->alloc;
+
+  m->alloc = alloc ? alloc * 2 : 1024;
+  m->keys = calloc(m->alloc, sizeof(*m->keys));
+  m->offs = malloc(m->alloc * sizeof(*m->offs));
+  if (m->keys == NULL || m->offs == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for (i = 0; i < alloc; i++) {
+    if (keys[i] != NULL) {
+      j = map_slot(m, keys[i]);
+      m->keys[j] = keys[i];
+      m->offs[j] = offs[i];
+    }
+  }
+  free(keys);
+  free(offs);
+}
+
+/* Where `name` ends up in the names section */
+static sn_ptr_t
+save_name(image_writer_t *w, char *name, size_t len)
+{
+  size_t at = buf_put(&w->names, name, len);
+  buf_put(&w->names, "", 1);
+  return at;
+}
+
+static obj_t *(*prim_func(sn_t *S, char *name))(sn_t *, int, obj_t **)
+{
+  module_entry_t *mod;
+  int i, j;
+
+  for (i = 0; i < S->Modules_index; i++) {
+    for (mod = S->Modules[i], j = 0; mod[j].name != NULL; j++) {
+      if (strcmp(mod[j].name, name) == 0) {
+        return mod[j].func;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* The offset `o` is saved as, copying it if it hasn't been yet */
+static obj_t *
+save_ref(sn_t *S, image_writer_t *w, obj_t *o)
+{
+  size_t i;
+
+  if (o == NULL || IMMEDIATE_P(o)) {
+    return o;
+  }
+
+  if ((w->map.count + 1) * 2 > w->map.alloc) {
+    map_grow(&w->map);
+  }
+  i = map_slot(&w->map, o);
+  if (w->map.keys[i] == NULL) {
+    w->map.keys[i] = o;
+    w->map.offs[i] = HEAP_OFF + buf_put(&w->heap, o, obj_size(o));
+    w->map.count++;
+  }
+  return (obj_t *)w->map.offs[i];
+}
+
+/* Turns the pointers of the copied object at `at` into offsets */
+static void
+save_fields(sn_t *S, image_writer_t *w, size_t at)
+{
+  obj_t *o = (obj_t *)(w->heap.data + at), *r;
+  char *name;
+  int i, n;
+
+#define SAVE(field) \
+  do { \
+    r = save_ref(S, w, (field)); \
+    o = (obj_t *)(w->heap.data + at); \
+    (field) = r; \
+  } while (0)
+
+  o->gcflags = 0;
+
+  switch (o->flag) {
+  case ATOM_T:
+    if (o->atom.flag == SYMBOL_T || o->atom.flag == KEYWORD_T) {
+      o->atom.string.data = (char *)save_name(w, o->atom.string.data,
+                                              o->atom.string.length);
+    }
+    else if (o->atom.flag == STRING_T && o->atom.slice) {
+      /* an offset into the parent's bytes */
+      o->atom.string.data = (char *)(o->atom.string.data
+                                     - (char *)(STRING_PARENT(o) + 1));
+      SAVE(STRING_PARENT(o));
+    }
+    else if (o->atom.flag == STRING_T) {
+      o->atom.string.data = NULL;
+    }
+    break;
+  case CONS_T:
+    SAVE(o->cons.car);
+    SAVE(o->cons.cdr);
+    break;
+  case CLOS_T:
+    SAVE(o->clos.code);
+    SAVE(o->clos.env);
+    break;
+  case FRAME_T:
+    SAVE(o->frame.up);
+    SAVE(o->frame.names);
+    for (i = 0, n = o->frame.length; i < n; i++) {
+      SAVE(FRAME_SLOTS(o)[i]);
+    }
+    break;
+  case BUILDER_T:
+    SAVE(o->builder.bytes);
+    break;
+  case HASH_T:
+    SAVE(o->hash.table);
+    SAVE(o->hash.old);
+    break;
+  case CODE_T:
+    o->code.site = 0;
+    SAVE(o->code.params);
+    for (i = 0, n = o->code.nconsts; i < n; i++) {
+      SAVE(CODE_CONSTS(o)[i]);
+    }
+    break;
+  case PRIM_T:
+    if ((name = prim_name(S, o->prim.func)) == NULL) {
+      fprintf(stderr, "ERROR: Can't save a primitive that isn't in a module\n");
+      exit(1);
+    }
+    o->prim.func = (void *)save_name(w, name, strlen(name));
+    break;
+  default:
+    break;
+  }
+
+#undef SAVE
+}
+
+/* Saves the interpreter to `path`. Returns -1, with errno set, on error */
+int
+image_save(sn_t *S, char *path)
+{
+  image_writer_t w;
+  image_header_t h;
+  obj_t **symtab, **globals;
+  size_t i, scan;
+  FILE *out;
+  int ok;
+
+  memset(&w, 0, sizeof(w));
+  memset(&h, 0, sizeof(h));
+
+  symtab = malloc(sizeof(*symtab) * S->Symtab_alloc);
+  globals = malloc(sizeof(*globals) * S->Globals_index);
+  if (symtab == NULL || globals == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  /* the roots, then everything they reach, breadth first */
+  for (i = 0; i < S->Symtab_alloc; i++) {
+    symtab[i] = save_ref(S, &w, S->Symtab[i]);
+  }
+  for (i = 0; i < S->Globals_index; i++) {
+    globals[i] = save_ref(S, &w, S->Globals[i]);
+  }
+  h.fn = (sn_ptr_t)save_ref(S, &w, S->FN);
+  h.if_ = (sn_ptr_t)save_ref(S, &w, S->IF);
+  h.quote = (sn_ptr_t)save_ref(S, &w, S->QUOTE);
+  h.true_ = (sn_ptr_t)save_ref(S, &w, S->TRUE);
+
+  for (scan = 0; scan < w.heap.len;
+       scan += obj_size((obj_t *)(w.heap.data + scan))) {
+    save_fields(S, &w, scan);
+  }
+
+  memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+  h.word_size = sizeof(sn_ptr_t);
+  h.obj_size = sizeof(obj_t);
+  h.heap_off = HEAP_OFF;
+  h.heap_size = w.heap.len;
+  h.symtab_off = h.heap_off + h.heap_size;
+  h.symtab_alloc = S->Symtab_alloc;
+  h.symtab_index = S->Symtab_index;
+  h.globals_off = h.symtab_off + sizeof(*symtab) * S->Symtab_alloc;
+  h.globals_index = S->Globals_index;
+  h.names_off = h.globals_off + sizeof(*globals) * S->Globals_index;
+  h.names_size = w.names.len;
+
+  ok = (out = fopen(path, "wb")) != NULL
+    && fwrite(&h, sizeof(h), 1, out) == 1
+    && fwrite("\0\0\0\0\0\0\0", 1, HEAP_OFF - sizeof(h), out) == HEAP_OFF - sizeof(h)
+    && fwrite(w.heap.data, 1, w.heap.len, out) == w.heap.len
+    && fwrite(symtab, sizeof(*symtab), S->Symtab_alloc, out) == S->Symtab_alloc
+    && fwrite(globals, sizeof(*globals), S->Globals_index, out) == S->Globals_index
+    && fwrite(w.names.data, 1, w.names.len, out) == w.names.len;
+  if (out != NULL && fclose(out) != 0) {
+    ok = 0;
+  }
+
+  free(w.heap.data);
+  free(w.names.data);
+  free(w.map.keys);
+  free(w.map.offs);
+  free(symtab);
+  free(globals);
+
+  return ok ? 0 : -1;
+}
+
+/**
+ * Replaces the interpreter's symbols and globals with those saved in
+ * the image at `path`. The modules it refers to must be installed
+ * first. Returns -1 if the file can't be read, and exits if it isn't
+ * a usable image.
+ */
+int
+image_load(sn_t *S, char *path)
+{
+  image_header_t *h;
+  struct stat st;
+  char *base, *names, *name;
+  obj_t *o, **slot, **saved;
+  size_t i, size;
+  int fd, n;
+
+#define LOAD(p) ((p) == NULL || IMMEDIATE_P(p) ? (p) : (obj_t *)(base + (sn_ptr_t)(p)))
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  size = st.st_size;
+  base = size < sizeof(*h) ? MAP_FAILED
+    : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  h = (image_header_t *)base;
+  if (base == MAP_FAILED
+      || memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0
+      || h->word_size != sizeof(sn_ptr_t) || h->obj_size != sizeof(obj_t)
+      || h->names_off + h->names_size != size) {
+    fprintf(stderr, "FATAL: %s is not an image for this build\n", path);
+    exit(1);
+  }
+
+  names = base + h->names_off;
+
+  for (o = (obj_t *)(base + h->heap_off);
+       (char *)o < base + h->heap_off + h->heap_size;
+       o = (obj_t *)((char *)o + obj_size(o))) {
+    switch (o->flag) {
+    case ATOM_T:
+      if (o->atom.flag == SYMBOL_T || o->atom.flag == KEYWORD_T) {
+        o->atom.string.data = names + (sn_ptr_t)o->atom.string.data;
+      }
+      else if (o->atom.flag == STRING_T && o->atom.slice) {
+        STRING_PARENT(o) = LOAD(STRING_PARENT(o));
+        o->atom.string.data = (char *)(STRING_PARENT(o) + 1)
+          + (sn_ptr_t)o->atom.string.data;
+      }
+      else if (o->atom.flag == STRING_T) {
+        o->atom.string.data = (char *)(o + 1);
+      }
+      break;
+    case CONS_T:
+      o->cons.car = LOAD(o->cons.car);
+      o->cons.cdr = LOAD(o->cons.cdr);
+      break;
+    case CLOS_T:
+      o->clos.code = LOAD(o->clos.code);
+      o->clos.env = LOAD(o->clos.env);
+      break;
+    case FRAME_T:
+      o->frame.up = LOAD(o->frame.up);
+      o->frame.names = LOAD(o->frame.names);
+      for (slot = FRAME_SLOTS(o), n = 0; n < o->frame.length; n++) {
+        slot[n] = LOAD(slot[n]);
+      }
+      break;
+    case BUILDER_T:
+      o->builder.bytes = LOAD(o->builder.bytes);
+      break;
+    case HASH_T:
+      o->hash.table = LOAD(o->hash.table);
+      o->hash.old = LOAD(o->hash.old);
+      break;
+    case CODE_T:
+      o->code.params = LOAD(o->code.params);
+      for (slot = CODE_CONSTS(o), n = 0; n < o->code.nconsts; n++) {
+        slot[n] = LOAD(slot[n]);
+      }
+      break;
+    case PRIM_T:
+      name = names + (sn_ptr_t)o->prim.func;
+      if ((o->prim.func = prim_func(S, name)) == NULL) {
+        fprintf(stderr, "FATAL: Unknown primitive in image: '%s'\n", name);
+        exit(1);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  S->Image = base + h->heap_off;
+  S->Image_end = S->Image + h->heap_size;
+
+  /* the tables are copied, since they get resized */
+  free(S->Symtab);
+  S->Symtab_alloc = h->symtab_alloc;
+  S->Symtab_index = h->symtab_index;
+  S->Symtab = malloc(sizeof(*S->Symtab) * S->Symtab_alloc);
+  free(S->Globals);
+  S->Globals_alloc = GLOBALS_INIT_SIZE;
+  while (S->Globals_alloc < h->globals_index) {
+    S->Globals_alloc *= 2;
+  }
+  S->Globals = calloc(S->Globals_alloc, sizeof(*S->Globals));
+  if (S->Symtab == NULL || S->Globals == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  saved = (obj_t **)(base + h->symtab_off);
+  for (i = 0; i < S->Symtab_alloc; i++) {
+    S->Symtab[i] = LOAD(saved[i]);
+  }
+
+  S->Globals_index = h->globals_index;
+  saved = (obj_t **)(base + h->globals_off);
+  for (i = 0; i < S->Globals_index; i++) {
+    S->Globals[i] = LOAD(saved[i]);
+  }
+
+  S->FN = LOAD((obj_t *)h->fn);
+  S->IF = LOAD((obj_t *)h->if_);
+  S->QUOTE = LOAD((obj_t *)h->quote);
+  S->TRUE = LOAD((obj_t *)h->true_);
+  S->Env = S->NIL;
+
+#undef LOAD
+
+  return 0;
+}
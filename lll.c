@@ -1,385 +1,443 @@
-#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-
-#ifdef __LP64__
-typedef uint64_t sn_ptr_t;
-typedef int64_t sn_int_t;
-#define SN_INT_BITS 63
-#else
-typedef uint32_t sn_ptr_t;
-typedef int32_t sn_int_t;
-#define SN_INT_BITS 31
-#endif
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #include "lll.h"
 
 
-static void print_atom(sn_t *S, FILE *out, atom_t a);
-static void print_cons(sn_t *S, FILE *out, cons_t a);
-
 #define isdelim(ch) (isspace(ch) || ch == '(' || ch == ')' || ch == '"')
 
 
-static void
-print_atom(sn_t *S, FILE *out, atom_t a)
+void
+reader_init(reader_t *r, int fd)
 {
-  int i;
-  switch (a.flag) {
-  case FIXNUM_T:
-    fprintf(out, "%ld", a.fixnum);
-    break;
-  case FLONUM_T:
-    fprintf(out, "%lf", a.flonum);
-    break;
-  case KEYWORD_T:
-  case SYMBOL_T:
-    fprintf(out, "%s", a.string.data);
-    break;
-  case STRING_T:
-    fputc('"', out);
-    for (i = 0; i < a.string.length; i++) {
-      if (a.string.data[i] == '"') {
-        fputc('\\', out);
-        fputc('"', out);
-      }
-      else {
-        fputc(a.string.data[i], out);
-      }
+  r->buf = malloc(READER_BUFFER_SIZE);
+  r->tok = malloc(READER_TOKEN_SIZE);
+  if (r->buf == NULL || r->tok == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  r->alloc = READER_BUFFER_SIZE;
+  r->pos = r->end = r->buf;
+  r->fd = fd;
+  r->eof = 0;
+  r->tok_alloc = READER_TOKEN_SIZE;
+}
+
+/* Reads from the file at `path`, mapped if possible. -1 on error */
+int
+reader_open(reader_t *r, char *path)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      reader_init(r, -1);
+      free(r->buf);
+      r->buf = r->pos = map;
+      r->end = r->buf + st.st_size;
+      r->alloc = 0;
+      return 0;
     }
-    fputc('"', out);
-    break;
   }
+
+  reader_init(r, fd);
+  return 0;
 }
 
-static void
-print_cons(sn_t *S, FILE *out, cons_t a)
+/* Reads the `len` bytes at `s`, which are copied */
+void
+reader_string(reader_t *r, char *s, size_t len)
 {
-  obj_t *obj;
-
-  if (ISNIL(a)) {
-    fprintf(out, "()");
-    return;
-  } 
-  fputc('(', out);
-  for (obj = a.car; obj; ) {
-    print_object(S, out, obj);
-    
-    obj = a.cdr;
-    if (obj && obj->flag == CONS_T) {
-      if (ISNIL(obj->cons)) {
-        break;
-      }
-      a = obj->cons;
-      obj = a.car;
-      fputc(' ', out);
-    } 
-    else if (obj) {
-      fputc(' ', out);
-      print_object(S, out, obj);
-      obj = NULL;
+  reader_init(r, -1);
+  if (len > r->alloc) {
+    r->buf = realloc(r->buf, len);
+    if (r->buf == NULL) {
+      perror("realloc");
+      exit(1);
     }
+    r->alloc = len;
   }
-  fputc(')', out);
+  memcpy(r->buf, s, len);
+  r->pos = r->buf;
+  r->end = r->buf + len;
 }
 
 void
-print_object(sn_t *S, FILE *out, obj_t *o)
+reader_close(reader_t *r)
+{
+  if (r->alloc == 0) {
+    munmap(r->buf, r->end - r->buf);
+  }
+  else {
+    free(r->buf);
+  }
+  if (r->fd > 2) {
+    close(r->fd);
+  }
+  free(r->tok);
+}
+
+/**
+ * Gets more input once pos has reached end. Everything before pos is
+ * dropped, so pointers into the buffer don't survive a refill.
+ * Returns 0 at the end of the input.
+ */
+static int
+reader_fill(reader_t *r)
+{
+  ssize_t n;
+
+  if (r->fd < 0) {
+    r->eof = 1;
+    return 0;
+  }
+
+  r->pos = r->end = r->buf;
+
+  /* whoever is at the other end may be waiting on a prompt */
+  fflush(stdout);
+
+  do {
+    n = read(r->fd, r->buf, r->alloc);
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    if (n < 0) {
+      perror("read");
+    }
+    r->eof = 1;
+    return 0;
+  }
+
+  r->end += n;
+  return 1;
+}
+
+#define READER_PEEK(r) \
+  ((r)->pos < (r)->end || reader_fill(r) ? (unsigned char)*(r)->pos : EOF)
+#define READER_NEXT(r) \
+  ((r)->pos < (r)->end || reader_fill(r) ? (unsigned char)*(r)->pos++ : EOF)
+
+/* Appends `ch` to the token being read, which is `n` bytes long */
+#define TOKEN_PUSH(r, n, ch) \
+  do { \
+    if ((n) + 1 >= (r)->tok_alloc) { \
+      token_grow(r); \
+    } \
+    (r)->tok[(n)++] = (ch); \
+  } while (0)
+
+static void
+token_grow(reader_t *r)
 {
-  switch (o->flag) {
-  case ATOM_T:
-    print_atom(S, out, o->atom);
-    break;
-  case CONS_T:
-    print_cons(S, out, o->cons);
-    break;
-  case CLOS_T:
-    fputs("<#Closure: ", out);
-    print_cons(S, out, o->cons);
-    fputs(">", out);
-    break;
-  case PRIM_T:
-    fputs("<#Primitive>", out);
-    break;
-  default:
-    fprintf(stderr, "Invalid object! Aborting\n");
+  r->tok_alloc *= 2;
+  r->tok = realloc(r->tok, r->tok_alloc);
+  if (r->tok == NULL) {
+    perror("realloc");
     exit(1);
   }
 }
 
 static obj_t *
-read_string(sn_t *S, FILE *in)
+read_string(sn_t *S, reader_t *r)
 {
-  char buffer[255];
-  int bufi = 0;
+  size_t n = 0;
   int ch, la;
 
-  while (bufi < 255) {
-    ch = fgetc(in);
+  for (;;) {
+    ch = READER_NEXT(r);
     if (ch == EOF) {
       fprintf(stderr, "ERROR: EOF while reading string.\n");
       return NULL;
     }
     if (ch == '"') {
-      buffer[bufi] = '\0';
-      return mk_str(S, buffer, bufi);
+      r->tok[n] = '\0';
+      return mk_str(S, r->tok, n);
     }
     else if (ch == '\\') {
-      la = fgetc(in);
+      la = READER_NEXT(r);
       if (la == EOF) {
         fprintf(stderr, "ERROR: EOF while reading string.\n");
         return NULL;
       }
       switch (la) {
       case '\\':
-        buffer[bufi++] = '\\';
+        TOKEN_PUSH(r, n, '\\');
         break;
       case '"':
-        buffer[bufi++] = '"';
+        TOKEN_PUSH(r, n, '"');
         break;
       case 'a':
-        buffer[bufi++] = '\a';
+        TOKEN_PUSH(r, n, '\a');
         break;
       case 'n':
-        buffer[bufi++] = '\n';
+        TOKEN_PUSH(r, n, '\n');
         break;
       case 'r':
-        buffer[bufi++] = '\r';
+        TOKEN_PUSH(r, n, '\r');
         break;
       case 't':
-        buffer[bufi++] = '\t';
+        TOKEN_PUSH(r, n, '\t');
         break;
       }
     } else {
-      buffer[bufi++] = ch;
+      TOKEN_PUSH(r, n, ch);
     }
   }
-  
-  fprintf(stderr, "ERROR: String too long\n");
-  return NULL;
 }
 
 static obj_t *
-read_number(sn_t *S, FILE *in, int negative)
+read_number(sn_t *S, reader_t *r, int negative)
 {
-  char buffer[32];
-  int bufi = 0;
+  size_t n = 0;
   int sawdot = 0;
   int ch;
   double floval;
   long fixval;
 
-  while (bufi < 32) {
-    ch = fgetc(in);
-    if (ch == EOF) {
-      fprintf(stderr, "ERROR: EOF while reading number\n");
-      return NULL;
-    }
-    
+  for (;;) {
+    ch = READER_PEEK(r);
+
     if (isdigit(ch)) {
-      buffer[bufi++] = ch;
+      TOKEN_PUSH(r, n, ch);
     }
     else if (ch == '.') {
       if (sawdot) {
         fprintf(stderr, "ERROR: Invalid number found\n");
         return NULL;
       }
-      else {
-        buffer[bufi++] = '.';
-        sawdot = 1;
-      }
+      TOKEN_PUSH(r, n, '.');
+      sawdot = 1;
     }
-    else if (isdelim(ch)) {
-      ungetc(ch, in);
-      /* have our number. Let's do it */
-      buffer[bufi] = '\0';
-      if (bufi > 0) {
-        if (sawdot) {
-          floval = strtod(buffer, NULL);
-          if (negative) {
-            floval *= -1.0;
-          }
-          return mk_flonum(S, floval);
-        }
-        else {
-          fixval = strtol(buffer, NULL, 10);
-          if (negative) {
-            fixval *= -1L;
-          }
-          return mk_fixnum(S, fixval);
-        }
-      }
-      else {
-        fprintf(stderr, "ERROR: Invalid number found\n");
-        return NULL;
-      }
+    else if (ch == EOF || isdelim(ch)) {
+      break;
+    }
+    else {
+      fprintf(stderr, "ERROR: Invalid number found\n");
+      return NULL;
     }
+    r->pos++;
   }
-  fprintf(stderr, "ERROR: Can't support numbers that large\n");
-  return NULL;
+
+  /* have our number. Let's do it */
+  r->tok[n] = '\0';
+  if (n == 0) {
+    fprintf(stderr, "ERROR: Invalid number found\n");
+    return NULL;
+  }
+  if (sawdot) {
+    floval = strtod(r->tok, NULL);
+    if (negative) {
+      floval *= -1.0;
+    }
+    return mk_flonum(S, floval);
+  }
+  fixval = strtol(r->tok, NULL, 10);
+  if (negative) {
+    fixval *= -1L;
+  }
+  return mk_fixnum(S, fixval);
 }
 
+/* `first`, if not 0, is the first character, already taken */
 static obj_t *
-read_symbol(sn_t *S, FILE *in)
+read_symbol(sn_t *S, reader_t *r, int first)
 {
-  char buffer[255];
-  int bufi = 0;
-  int ch, la, sawdot = -1;
+  size_t n = 0;
+  int ch, sawdot = -1;
   obj_t *module, *identifier;
+  char *buffer;
 
-  while (bufi < 255) {
-    ch = fgetc(in);
-    if (ch == EOF) {
-      fprintf(stderr, "ERROR: EOF while reading string.\n");
-      return NULL;
-    }
+  if (first) {
+    TOKEN_PUSH(r, n, first);
+  }
 
-    if (isalnum(ch)) {
-      buffer[bufi++] = ch;
-    }
-    else if (ch == '.') { /* TODO: Need to turn this into a refer form ideally ... */
-      sawdot = bufi;
-      buffer[bufi++] = ch;
-    }
-    else if (isgraph(ch) && !isdelim(ch)) {
-      buffer[bufi++] = ch;
+  for (;;) {
+    ch = READER_PEEK(r);
+    if (ch == EOF || isdelim(ch)) {
+      break;
     }
-    else if (isdelim(ch)) {
-      ungetc(ch, in);
-      buffer[bufi] = '\0';
-
-      /* This is a bit hacky */
-      if (sawdot > 0) {
-        buffer[sawdot] = '\0';
-        module = intern(S, buffer, sawdot);
-        buffer[sawdot] = ':';
-        identifier = intern(S, buffer + sawdot, bufi - sawdot);
-        /* TODO: potentially namespace the refer */
-        return cons(S, intern(S, "refer", 5),
-                    cons(S, module, 
-                         cons(S, identifier, S->NIL)));
-      }
+    r->pos++;
 
-      return intern(S, buffer, bufi);
+    if (ch == '.') { /* TODO: Need to turn this into a refer form ideally ... */
+      sawdot = n;
+      TOKEN_PUSH(r, n, ch);
+    }
+    else if (isgraph(ch)) {
+      TOKEN_PUSH(r, n, ch);
     }
     else {
       fprintf(stderr, "ERROR: Invalid symbol character\n");
       return NULL;
     }
   }
-}
 
-static char
-eat_space(FILE *in)
-{
-  int ch;
-  do {
-    ch = fgetc(in);
-  } while (isspace(ch));
-  return ch;
+  buffer = r->tok;
+  buffer[n] = '\0';
+
+  /* This is a bit hacky */
+  if (sawdot > 0) {
+    buffer[sawdot] = '\0';
+    module = intern(S, buffer, sawdot);
+    GC_PROTECT(S, module);
+    buffer[sawdot] = ':';
+    identifier = intern(S, buffer + sawdot, n - sawdot);
+    identifier = cons(S, identifier, S->NIL);
+    module = cons(S, module, identifier);
+    identifier = intern(S, "refer", 5);
+    /* TODO: potentially namespace the refer */
+    identifier = cons(S, identifier, module);
+    GC_UNPROTECT(S, 1);
+    return identifier;
+  }
+
+  return intern(S, buffer, n);
 }
 
-static obj_t *
-read_list(sn_t *S, FILE *in)
+/* Skips white space, returning the next character without taking it */
+static int
+eat_space(reader_t *r)
 {
-  obj_t *obj;
   int ch;
-  ch = fgetc(in);
-  if (ch == EOF) {
-    fprintf(stderr, "ERROR: EOF while reading list.\n");
-    return NULL;
-  }
-
-  /* Is this just nil? */
-  if (ch == ')') {
-    return S->NIL;
-  }
-  else {
-    ungetc(ch, in);
-  }
 
-  /* Ok. Legitimate list it seems. Let's read it recursively */
-  obj = read_object(S, in);
-  if (!obj) {
-    return obj;
+  while ((ch = READER_PEEK(r)) != EOF && isspace(ch)) {
+    r->pos++;
   }
-
-  ch = eat_space(in);
-  if (ch == ')') {
-    return cons(S, obj, S->NIL);
-  } 
-
-  ungetc(ch, in);
-  return cons(S, obj, read_list(S, in));
+  return ch;
 }
 
+/**
+ * Reads one object. Lists are read without recursion: `stack` holds a
+ * (head . last cell) pair for each list being read, innermost first,
+ * with QUOTE standing in for a pending ' around the next object.
+ */
 obj_t *
-read_object(sn_t *S, FILE *in)
+read_object(sn_t *S, reader_t *r)
 {
-  obj_t *tmp;
+  obj_t *stack = S->NIL, *obj = NULL, *frame, *cell;
   int ch, la;
- next:
-  ch = fgetc(in);
-  if (ch == EOF) {
-    return NULL;
-  }
 
-  switch (ch) {
-  case '(':
-    return read_list(S, in);
-  case ';': /* read til end of line */
-    while ((ch = fgetc(in)) != '\n') {
-      if (ch == EOF) {
-        return NULL;
+  GC_PROTECT(S, stack);
+  GC_PROTECT(S, obj);
+
+  for (;;) {
+    ch = eat_space(r);
+    if (ch == EOF) {
+      if (stack != S->NIL) {
+        fprintf(stderr, "ERROR: EOF while reading list.\n");
+      }
+      obj = NULL;
+      break;
+    }
+
+    switch (ch) {
+    case '(':
+      r->pos++;
+      frame = cons(S, S->NIL, S->NIL);
+      stack = cons(S, frame, stack);
+      continue;
+    case ')':
+      r->pos++;
+      if (!FLAG_P(car(S, stack), CONS_T)) {
+        fprintf(stderr, "ERROR: Unexpected ')'\n");
+        obj = NULL;
+        break;
+      }
+      obj = car(S, stack)->cons.car;
+      stack = cdr(S, stack);
+      break;
+    case ';': /* read til end of line */
+      while ((ch = READER_NEXT(r)) != '\n' && ch != EOF)
+        ;
+      continue;
+    case '"':
+      r->pos++;
+      obj = read_string(S, r);
+      break;
+    case '\'':
+      r->pos++;
+      stack = cons(S, S->QUOTE, stack);
+      continue;
+    case '-':
+    case '+':
+      r->pos++;
+      la = READER_PEEK(r);
+      if (isdigit(la)) {
+        obj = read_number(S, r, ch == '-');
+      }
+      else {
+        obj = read_symbol(S, r, ch);
+      }
+      break;
+    default:
+      if (isdigit(ch)) {
+        obj = read_number(S, r, 0);
       }
+      else {
+        obj = read_symbol(S, r, 0);
+      }
+    }
+
+    if (obj == NULL) {
+      break;
     }
-    goto next;
-  case ' ':
-  case '\t':
-  case '\n':
-  case '\r':
-    goto next;
-  case '"':
-    return read_string(S, in);
-  case '\'':
-    tmp = read_object(S, in);
-    if (tmp != NULL) {
-      return cons(S, S->QUOTE, cons(S,tmp, S->NIL));
+
+    while (car(S, stack) == S->QUOTE) {
+      stack = cdr(S, stack);
+      obj = cons(S, obj, S->NIL);
+      obj = cons(S, S->QUOTE, obj);
     }
-    return tmp;
-  case '-':
-  case '+':
-    la = fgetc(in);
-    if (la == EOF) {
-      fprintf(stderr, "ERROR: eof reached in mid form\n");
-      return NULL;
+    if (stack == S->NIL) {
+      break;
     }
-    if (isdigit(la)) {
-      ungetc(la, in);
-      return read_number(S, in, ch == '-');
+
+    /* append to the innermost list */
+    cell = cons(S, obj, S->NIL);
+    frame = car(S, stack);
+    if (frame->cons.car == S->NIL) {
+      frame->cons.car = cell;
     }
     else {
-      ungetc(la, in);
-    }
-  default:
-    ungetc(ch, in);
-    if (isdigit(ch)) {
-      return read_number(S, in, 0);
+      frame->cons.cdr->cons.cdr = cell;
+      GC_WRITE(S, frame->cons.cdr);
     }
+    frame->cons.cdr = cell;
+    GC_WRITE(S, frame);
   }
-  return read_symbol(S, in);
+
+  GC_UNPROTECT(S, 2);
+  return obj;
 }
 
 obj_t *
 mk_fixnum(sn_t *S, long d)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
+  obj_t *o;
+
+  if (d >= FIXNUM_MIN && d <= FIXNUM_MAX) {
+    return MK_FIXNUM(d);
   }
 
+  o = GC_ALLOC(S, sizeof(*o));
+  ALLOC_PROFILE_COUNT(S, ALLOC_FIXNUM, sizeof(*o));
+
   o->flag = ATOM_T;
   o->atom.flag = FIXNUM_T;
   o->atom.fixnum = d;
@@ -390,12 +448,9 @@ mk_fixnum(sn_t *S, long d)
 obj_t *
 mk_flonum(sn_t *S, double d)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
-  }
+  obj_t *o = GC_ALLOC(S, sizeof(*o));
 
+  ALLOC_PROFILE_COUNT(S, ALLOC_FLONUM, sizeof(*o));
   o->flag = ATOM_T;
   o->atom.flag = FLONUM_T;
   o->atom.flonum = d;
@@ -403,154 +458,347 @@ mk_flonum(sn_t *S, double d)
   return o;
 }
 
+/* `str` may be NULL, to fill in the bytes afterwards */
 obj_t *
 mk_str(sn_t *S, char *str, size_t len)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
-  }
+  obj_t *o = gc_alloc(S, sizeof(*o) + GC_ALIGN(len + 1));
 
+  ALLOC_PROFILE_COUNT(S, ALLOC_STRING, sizeof(*o) + GC_ALIGN(len + 1));
+  /* the bytes live inline after the object so they move with it */
   o->flag = ATOM_T;
   o->atom.flag = STRING_T;
-  o->atom.string.data = strndup(str, len);
+  o->atom.slice = 0;
+  o->atom.string.data = (char *)(o + 1);
   o->atom.string.length = len;
+  if (str != NULL) {
+    memcpy(o->atom.string.data, str, len);
+  }
+  o->atom.string.data[len] = '\0';
 
   return o;
 }
 
+/* `len` bytes of the string `str` from `start`, without copying them */
 obj_t *
-mk_sym(sn_t *S, char *str, size_t len, int keywordp)
+mk_slice(sn_t *S, obj_t *str, size_t start, size_t len)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
+  obj_t *o;
+  size_t size = sizeof(*o) + sizeof(obj_t *);
+
+  if (str->atom.slice) {
+    start += str->atom.string.data - STRING_PARENT(str)->atom.string.data;
+    str = STRING_PARENT(str);
+  }
+  if (!GC_ROOM(S, size)) {
+    GC_PROTECT(S, str);
+    o = gc_alloc(S, size);
+    GC_UNPROTECT(S, 1);
   }
+  else {
+    o = GC_BUMP(S, size);
+  }
+  ALLOC_PROFILE_COUNT(S, ALLOC_STRING, size);
 
   o->flag = ATOM_T;
-  o->atom.flag = keywordp ? KEYWORD_T : SYMBOL_T;
-  o->atom.string.data = strndup(str, len);
+  o->atom.flag = STRING_T;
+  o->atom.slice = 1;
+  o->atom.string.data = str->atom.string.data + start;
   o->atom.string.length = len;
+  STRING_PARENT(o) = str;
 
   return o;
 }
 
-obj_t *
-intern(sn_t *S, char *str, size_t len)
+/**
+ * Copies a symbol name into the string arena. Names are never freed,
+ * since interned symbols live as long as the interpreter.
+ */
+static char *
+strings_copy(sn_t *S, char *str, size_t len)
 {
-  int i, keywordp = 0;
-  obj_t *sym;
-  if (S->Symtab_index > 0) {
-    for (i = 0; i < S->Symtab_index; i++) {
-      if (len != S->Symtab[i]->atom.string.length) {
-        continue;
-      }
-      if (strncmp(S->Symtab[i]->atom.string.data, str, len) == 0) {
-        return S->Symtab[i];
-      }
+  char *p;
+  size_t size = STRINGS_BLOCK_SIZE;
+
+  if (S->Strings_next + len + 1 > S->Strings_limit) {
+    if (len + 1 > size) {
+      size = len + 1;
     }
+    S->Strings_next = malloc(size);
+    if (S->Strings_next == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    S->Strings_limit = S->Strings_next + size;
   }
-  
-  /* Make the symbol, or keyword. NOTE: Sym("foo") == Key("foo") */
-  if (str[0] == ':') {
-    keywordp = 1;
-    sym = mk_sym(S, str, len, keywordp);
-  }
-  else {
-    sym = mk_sym(S, str, len, keywordp);
+
+  p = S->Strings_next;
+  memcpy(p, str, len);
+  p[len] = '\0';
+  S->Strings_next += len + 1;
+  return p;
+}
+
+obj_t *
+mk_sym(sn_t *S, char *str, size_t len, int keywordp)
+{
+  obj_t *o = GC_ALLOC(S, sizeof(*o));
+
+  ALLOC_PROFILE_COUNT(S, ALLOC_SYMBOL, sizeof(*o));
+  o->flag = ATOM_T;
+  o->atom.flag = keywordp ? KEYWORD_T : SYMBOL_T;
+  o->atom.global = 0;
+  o->atom.string.data = strings_copy(S, str, len);
+  o->atom.string.length = len;
+
+  return o;
+}
+
+/* FNV-1a */
+size_t
+string_hash(char *str, size_t len)
+{
+  size_t i, h = 2166136261u;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)str[i]) * 16777619u;
   }
+  return h;
+}
+
+static void
+symtab_grow(sn_t *S)
+{
+  obj_t **old = S->Symtab, *sym;
+  size_t i, j, mask, old_alloc = S->Symtab_alloc;
 
-  if (S->Symtab_index < S->Symtab_alloc) {
-    S->Symtab[S->Symtab_index++] = sym;
-    return sym;
+  S->Symtab_alloc = old_alloc ? old_alloc * 2 : SYMTAB_INIT_SIZE;
+  S->Symtab = calloc(S->Symtab_alloc, sizeof(*S->Symtab));
+  if (S->Symtab == NULL) {
+    perror("calloc");
+    exit(1);
   }
-  else if (S->Symtab_alloc == 0) {
-    S->Symtab = malloc(sizeof(*S->Symtab) * SYMTAB_INIT_SIZE);
-    if (S->Symtab == NULL) {
-      perror("malloc");
-      exit(1);
+
+  mask = S->Symtab_alloc - 1;
+  for (i = 0; i < old_alloc; i++) {
+    if ((sym = old[i]) == NULL) {
+      continue;
+    }
+    j = string_hash(sym->atom.string.data, sym->atom.string.length) & mask;
+    while (S->Symtab[j] != NULL) {
+      j = (j + 1) & mask;
     }
-    S->Symtab_alloc = SYMTAB_INIT_SIZE;
+    S->Symtab[j] = sym;
   }
-  else { /* resize it */
-    S->Symtab_alloc *= 2;
-    S->Symtab = realloc(S->Symtab, sizeof(*S->Symtab) * S->Symtab_alloc);
-    if (S->Symtab == NULL) {
-      perror("realloc");
-      exit(1);
+  free(old);
+}
+
+/**
+ * Symtab is an open-addressing hash table with linear probing, kept
+ * at most half full.
+ */
+obj_t *
+intern(sn_t *S, char *str, size_t len)
+{
+  size_t i, mask;
+  obj_t *sym;
+
+  if ((S->Symtab_index + 1) * 2 > S->Symtab_alloc) {
+    symtab_grow(S);
+  }
+
+  mask = S->Symtab_alloc - 1;
+  for (i = string_hash(str, len) & mask; (sym = S->Symtab[i]) != NULL;
+       i = (i + 1) & mask) {
+    if (sym->atom.string.length == len
+        && memcmp(sym->atom.string.data, str, len) == 0) {
+      return sym;
     }
   }
 
-  S->Symtab[S->Symtab_index++] = sym;
+  /* Make the symbol, or keyword. NOTE: Sym("foo") == Key("foo") */
+  sym = mk_sym(S, str, len, len > 0 && str[0] == ':');
+
+  /* the table isn't resized by the collector, so i is still good */
+  S->Symtab[i] = sym;
+  S->Symtab_index++;
   return sym;
 }
 
+/* `code` is a CODE_T, checked by compile */
 obj_t *
 mk_clos(sn_t *S, obj_t *code, obj_t *env)
 {
-  obj_t *o = cons(S, code, env);
+  obj_t *o;
+
+  if (!GC_ROOM(S, sizeof(*o))) {
+    GC_PROTECT(S, code);
+    GC_PROTECT(S, env);
+    gc_reserve(S, sizeof(*o));
+    GC_UNPROTECT(S, 2);
+  }
+  o = GC_BUMP(S, sizeof(*o));
+  ALLOC_PROFILE_COUNT(S, ALLOC_CLOSURE, sizeof(*o));
+
   o->flag = CLOS_T;
+  o->clos.code = code;
+  o->clos.env = env;
+  o->clos.arity = code->code.arity;
 
   return o;
 }
 
+/**
+ * A frame holds the values of one closure application in `length`
+ * slots stored inline after the object, and links to the frame of the
+ * enclosing closure.
+ */
 obj_t *
-mk_prim(sn_t *S, obj_t *(*func)(sn_t *, obj_t *), int arity, int max_arity)
+mk_frame(sn_t *S, obj_t *up, obj_t *names, int length)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
-  }
+  obj_t *o;
+  size_t size = sizeof(*o) + GC_ALIGN(length * sizeof(obj_t *));
+  int i;
 
-  o->flag = PRIM_T;
-  o->prim.arity = arity;
-  o->prim.max_arity = arity;
-  o->prim.func = func;
+  if (!GC_ROOM(S, size)) {
+    GC_PROTECT(S, up);
+    GC_PROTECT(S, names);
+    o = gc_alloc(S, size);
+    GC_UNPROTECT(S, 2);
+  }
+  else {
+    o = GC_BUMP(S, size);
+  }
+  ALLOC_PROFILE_COUNT(S, ALLOC_FRAME, size);
+
+  o->flag = FRAME_T;
+  o->frame.up = up;
+  o->frame.names = names;
+  o->frame.length = length;
+  for (i = 0; i < length; i++) {
+    FRAME_SLOTS(o)[i] = S->NIL;
+  }
 
   return o;
 }
 
-
+/* Elements start out as zero. Both element types take 8 bytes */
 obj_t *
-cons(sn_t *S, obj_t *a, obj_t *d)
+mk_vector(sn_t *S, vec_type_t type, long length)
 {
-  obj_t *o = malloc(sizeof(*o));
-  if (o == NULL) {
-    perror("malloc");
-    exit(1);
-  }
+  size_t bytes = length * sizeof(int64_t);
+  obj_t *o = gc_alloc(S, sizeof(*o) + GC_ALIGN(bytes));
 
-  o->flag = CONS_T;
-  o->cons.car = a;
-  o->cons.cdr = d;
+  ALLOC_PROFILE_COUNT(S, ALLOC_VECTOR, sizeof(*o) + GC_ALIGN(bytes));
+  o->flag = VECTOR_T;
+  o->vector.type = type;
+  o->vector.length = length;
+  memset(o + 1, 0, bytes);
 
   return o;
 }
 
+/* `capacity` is the number of pairs, a power of two */
 obj_t *
-car(sn_t *S, obj_t *a)
+mk_hash(sn_t *S, int capacity)
 {
-  if (!a || a->flag != CONS_T) {
-    fprintf(stderr, "ERROR: Attempt to take car of non-cons\n");
-    return NULL;
-  }
+  obj_t *o, *table = mk_frame(S, S->NIL, S->NIL, capacity * 2);
 
-  if (a->cons.car == NULL) {
-    return S->NIL;
-  }
-  return a->cons.car;
+  GC_PROTECT(S, table);
+  o = GC_ALLOC(S, sizeof(*o));
+  GC_UNPROTECT(S, 1);
+  ALLOC_PROFILE_COUNT(S, ALLOC_HASH, sizeof(*o));
+
+  o->flag = HASH_T;
+  o->hash.table = table;
+  o->hash.old = S->NIL;
+  o->hash.count = 0;
+  o->hash.moved = 0;
+
+  return o;
 }
 
+/* Empty, with room for `capacity` bytes */
 obj_t *
-cdr(sn_t *S, obj_t *a)
+mk_builder(sn_t *S, size_t capacity)
 {
-  if (!a || a->flag != CONS_T) {
-    fprintf(stderr, "ERROR: Attempt to take cdr of non-cons\n");
-    return NULL;
-  }
+  obj_t *o, *bytes = mk_str(S, NULL, capacity);
+
+  GC_PROTECT(S, bytes);
+  o = GC_ALLOC(S, sizeof(*o));
+  GC_UNPROTECT(S, 1);
+  ALLOC_PROFILE_COUNT(S, ALLOC_BUILDER, sizeof(*o));
+
+  o->flag = BUILDER_T;
+  o->builder.bytes = bytes;
+  o->builder.length = 0;
+
+  return o;
+}
+
+obj_t *
+mk_prim(sn_t *S, obj_t *(*func)(sn_t *, int, obj_t **), int arity,
+        int max_arity)
+{
+  obj_t *o = GC_ALLOC(S, sizeof(*o));
+
+  ALLOC_PROFILE_COUNT(S, ALLOC_PRIM, sizeof(*o));
+  o->flag = PRIM_T;
+  o->prim.arity = arity;
+  o->prim.max_arity = max_arity;
+  o->prim.func = func;
+
+  return o;
+}
+
+
+obj_t *
+cons(sn_t *S, obj_t *a, obj_t *d)
+{
+  obj_t *o;
+
+  if (!GC_ROOM(S, sizeof(*o))) {
+    GC_PROTECT(S, a);
+    GC_PROTECT(S, d);
+    gc_reserve(S, sizeof(*o));
+    GC_UNPROTECT(S, 2);
+  }
+  o = GC_BUMP(S, sizeof(*o));
+  ALLOC_PROFILE_COUNT(S, ALLOC_CONS, sizeof(*o));
+
+  o->flag = CONS_T;
+  o->cons.car = a;
+  o->cons.cdr = d;
+
+  return o;
+}
+
+obj_t *
+car(sn_t *S, obj_t *a)
+{
+  if (a == S->NIL) {
+    return S->NIL;
+  }
+  if (!FLAG_P(a, CONS_T)) {
+    fprintf(stderr, "ERROR: Attempt to take car of non-cons\n");
+    return NULL;
+  }
+
+  if (a->cons.car == NULL) {
+    return S->NIL;
+  }
+  return a->cons.car;
+}
+
+obj_t *
+cdr(sn_t *S, obj_t *a)
+{
+  if (a == S->NIL) {
+    return S->NIL;
+  }
+  if (!FLAG_P(a, CONS_T)) {
+    fprintf(stderr, "ERROR: Attempt to take cdr of non-cons\n");
+    return NULL;
+  }
 
   if (a->cons.cdr == NULL) {
     return S->NIL;
@@ -562,7 +810,7 @@ int
 length(sn_t *S, obj_t *a)
 {
   int i = 0;
-  if (a->flag == CONS_T) {
+  if (FLAG_P(a, CONS_T)) {
     /* TODO this doesnt' handle cycles... */
     while (a != NULL && a != S->NIL) {
       i++;
@@ -572,85 +820,511 @@ length(sn_t *S, obj_t *a)
   return i;
 }
 
+#if defined(TRACE_DEBUG) || defined(VM_PROFILE) || defined(ALLOC_PROFILE)
+static const char *opcode_names[] = {
+  "CONST", "LOCAL", "GLOBAL", "CLOSURE", "FRAME", "ARG", "CALL",
+  "TAIL_CALL", "JUMP", "JUMP_IF_FALSE", "RETURN", "DONE",
+  "ARG_LOCAL", "JUMP_UNLESS_LOCAL", "CALL_GLOBAL", "TAIL_CALL_GLOBAL",
+  "TAIL_CALL_SELF"
+};
+#endif
+
+#ifdef TRACE_DEBUG
+#define TRACE_OP() \
+  fprintf(stderr, "TRACE: %4d %s\n", pc - 1, opcode_names[op])
+#else
+#define TRACE_OP()
+#endif
+
+/**
+ * In a -DVM_PROFILE build, each dispatch charges what was allocated
+ * (and with -DVM_PROFILE_TICKS, the time taken) since the previous one
+ * to the previous instruction, and counts the new one.
+ */
+#ifdef VM_PROFILE
+
+#if defined(VM_PROFILE_TICKS) && defined(__GNUC__) \
+  && (defined(__x86_64__) || defined(__i386__))
+#define profile_ticks() __builtin_ia32_rdtsc()
+#elif defined(VM_PROFILE_TICKS)
+static unsigned long long
+profile_ticks(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#else
+#define profile_ticks() 0ULL
+#endif
+
+/* Starts measuring from here, without charging anything */
+static void
+profile_start(sn_t *S)
+{
+  S->Profile_op = OP_DONE;
+  S->Profile_bytes = gc_allocated(S);
+  S->Profile_ticks = profile_ticks();
+}
+
+/* Charges the instruction that just finished, and starts `op` */
+static void
+profile_op(sn_t *S, opcode_t op)
+{
+  op_profile_t *p = &S->Profile[S->Profile_op];
+  size_t bytes = gc_allocated(S);
+  unsigned long long ticks = profile_ticks();
+
+  p->bytes += bytes - S->Profile_bytes;
+  p->ticks += ticks - S->Profile_ticks;
+  S->Profile_bytes = bytes;
+  S->Profile_ticks = ticks;
+
+  S->Profile[op].count++;
+  S->Profile_op = op;
+}
+
+#define PROFILE_OP() profile_op(S, op)
+#define PROFILE_COUNT(S, field) ((S)->Profile[(S)->Profile_op].field++)
+
+void
+vm_profile_reset(sn_t *S)
+{
+  memset(S->Profile, 0, sizeof(S->Profile));
+  S->Profile_bytes = gc_allocated(S);
+  S->Profile_ticks = profile_ticks();
+}
+
+/* A table of the counts so far, busiest opcode first */
+void
+vm_profile_dump(sn_t *S, FILE *out)
+{
+  int order[OP_COUNT], i, j, t;
+  unsigned long total = 0;
+
+  for (i = 0; i < OP_COUNT; i++) {
+    order[i] = i;
+    total += S->Profile[i].count;
+  }
+  for (i = 1; i < OP_COUNT; i++) {
+    for (j = i; j > 0 && S->Profile[order[j]].count
+           > S->Profile[order[j - 1]].count; j--) {
+      t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  }
+
+  fprintf(out, "%-20s %12s %6s %12s %10s %10s %14s %8s\n", "opcode",
+          "count", "%", "bytes", "frames", "envs", "ticks", "per op");
+  for (i = 0; i < OP_COUNT; i++) {
+    op_profile_t *p = &S->Profile[order[i]];
+    if (p->count == 0) {
+      break;
+    }
+    fprintf(out, "%-20s %12lu %6.2f %12lu %10lu %10lu %14llu %8.1f\n",
+            opcode_names[order[i]], p->count, 100.0 * p->count / total,
+            p->bytes, p->frames, p->envs, p->ticks,
+            (double)p->ticks / p->count);
+  }
+}
+
+#else
+#define PROFILE_OP()
+#define PROFILE_COUNT(S, field)
+#endif
+
+/**
+ * In a -DALLOC_PROFILE build, every object made is counted by kind,
+ * against the instruction being run and against its site: the
+ * primitive being applied or else the code being run.
+ */
+#ifdef ALLOC_PROFILE
+
+static const char *alloc_kind_names[ALLOC_KINDS] = {
+  "cons", "fixnum", "flonum", "string", "symbol", "closure", "frame",
+  "code", "prim", "vector", "hash", "builder"
+};
+
+static int
+alloc_site(sn_t *S)
+{
+  if (S->Alloc_op == OP_COUNT) {
+    return 0;
+  }
+  else if (S->Alloc_prim != NULL) {
+    return prim_site(S, S->Alloc_prim);
+  }
+  return code_site(S, S->Code);
+}
+
+void
+alloc_profile(sn_t *S, alloc_kind_t kind, size_t size)
+{
+  alloc_count_t *c = &S->Alloc[S->Alloc_op][kind];
+  int site = alloc_site(S); /* may move S->Sites */
+
+  c->count++;
+  c->bytes += size;
+  c = &S->Sites[site].kinds[kind];
+  c->count++;
+  c->bytes += size;
+}
+
+void
+alloc_profile_reset(sn_t *S)
+{
+  int i;
+
+  memset(S->Alloc, 0, sizeof(S->Alloc));
+  for (i = 0; i < S->Sites_index; i++) {
+    memset(S->Sites[i].kinds, 0, sizeof(S->Sites[i].kinds));
+  }
+}
+
+/* One row: the totals of `kinds`, then the kinds that were made */
+static void
+alloc_row(FILE *out, const char *name, alloc_count_t *kinds)
+{
+  unsigned long count = 0, bytes = 0;
+  int i;
+
+  for (i = 0; i < ALLOC_KINDS; i++) {
+    count += kinds[i].count;
+    bytes += kinds[i].bytes;
+  }
+  fprintf(out, "%-24s %12lu %14lu ", name, count, bytes);
+  for (i = 0; i < ALLOC_KINDS; i++) {
+    if (kinds[i].count != 0) {
+      fprintf(out, " %s=%lu", alloc_kind_names[i], kinds[i].count);
+    }
+  }
+  fputc('\n', out);
+}
+
+static unsigned long
+alloc_bytes(alloc_count_t *kinds)
+{
+  unsigned long bytes = 0;
+  int i;
+
+  for (i = 0; i < ALLOC_KINDS; i++) {
+    bytes += kinds[i].bytes;
+  }
+  return bytes;
+}
+
+/* Prints the rows that allocated anything, most bytes first */
+static void
+alloc_table(FILE *out, const char *title, const char **names,
+            alloc_count_t **rows, int n)
+{
+  int *order, i, j, t;
+
+  order = malloc(sizeof(*order) * n);
+  if (order == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && alloc_bytes(rows[order[j]])
+           > alloc_bytes(rows[order[j - 1]]); j--) {
+      t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  }
+
+  fprintf(out, "\n%-24s %12s %14s  %s\n", title, "count", "bytes", "kinds");
+  for (i = 0; i < n && alloc_bytes(rows[order[i]]) != 0; i++) {
+    alloc_row(out, names[order[i]], rows[order[i]]);
+  }
+
+  free(order);
+}
+
+/* Tables by kind, by opcode and by site */
+void
+alloc_profile_dump(sn_t *S, FILE *out)
+{
+  alloc_count_t total[ALLOC_KINDS], *ops[OP_COUNT + 1], **sites;
+  const char *op_names[OP_COUNT + 1], **site_names;
+  int i, j, n = S->Sites_index;
+
+  memset(total, 0, sizeof(total));
+  for (i = 0; i <= OP_COUNT; i++) {
+    for (j = 0; j < ALLOC_KINDS; j++) {
+      total[j].count += S->Alloc[i][j].count;
+      total[j].bytes += S->Alloc[i][j].bytes;
+    }
+  }
+
+  fprintf(out, "%-24s %12s %14s\n", "kind", "count", "bytes");
+  for (i = 0; i < ALLOC_KINDS; i++) {
+    if (total[i].count != 0) {
+      fprintf(out, "%-24s %12lu %14lu\n", alloc_kind_names[i],
+              total[i].count, total[i].bytes);
+    }
+  }
+
+  for (i = 0; i < OP_COUNT; i++) {
+    ops[i] = S->Alloc[i];
+    op_names[i] = opcode_names[i];
+  }
+  ops[OP_COUNT] = S->Alloc[OP_COUNT];
+  op_names[OP_COUNT] = "(outside the VM)";
+  alloc_table(out, "opcode", op_names, ops, OP_COUNT + 1);
+
+  sites = malloc(sizeof(*sites) * n);
+  site_names = malloc(sizeof(*site_names) * n);
+  if (sites == NULL || site_names == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    sites[i] = S->Sites[i].kinds;
+    site_names[i] = S->Sites[i].name;
+  }
+  alloc_table(out, "site", site_names, sites, n);
+  free(sites);
+  free(site_names);
+}
+
+#define ALLOC_OP() (S->Alloc_op = op)
+#define ALLOC_PRIM(f) (S->Alloc_prim = (f))
+#else
+#define ALLOC_OP()
+#define ALLOC_PRIM(f)
+#endif
+
+/* Takes a sample if the profiler asked for one, see sample.c */
+#define SAMPLE_POINT(prim) \
+  do { \
+    if (sample_pending) { \
+      sample_take(S, (prim)); \
+    } \
+  } while (0)
+
+/* Whether primitive p takes n arguments */
+#define PRIM_ARITY_P(p, n) \
+  ((n) >= (p)->prim.arity \
+   && ((p)->prim.max_arity < 0 || (n) <= (p)->prim.max_arity))
+
+/* Val = primitive Val applied to the newest n Args, which it pops */
+#define APPLY_PRIM(n) \
+  do { \
+    if (!PRIM_ARITY_P(S->Val, (n))) { \
+      arity_error(S, S->Val, (n)); \
+    } \
+    prim = S->Val->prim.func; \
+    ALLOC_PRIM(prim); \
+    S->Val = prim(S, (n), S->Args + S->Args_index - (n)); \
+    S->Args_index -= (n); \
+    ALLOC_PRIM(NULL); \
+    SAMPLE_POINT(prim); \
+  } while (0)
+
+static void
+arity_error(sn_t *S, obj_t *prim, int argc)
+{
+  char *name = prim_name(S, prim->prim.func);
+  int min = prim->prim.arity, max = prim->prim.max_arity;
+
+  if (name == NULL) {
+    name = "primitive";
+  }
+  if (min == max) {
+    fprintf(stderr, "ARITY_ERROR: %s requires %d argument%s, got %d\n",
+            name, min, min == 1 ? "" : "s", argc);
+  }
+  else if (max < 0) {
+    fprintf(stderr, "ARITY_ERROR: %s requires at least %d argument%s, "
+            "got %d\n", name, min, min == 1 ? "" : "s", argc);
+  }
+  else {
+    fprintf(stderr, "ARITY_ERROR: %s requires %d to %d arguments, got %d\n",
+            name, min, max, argc);
+  }
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Applies primitive `prim` to the argc values in argv, for primitives
+ * that call others, like vec-map. argv has to be GC protected.
+ */
+obj_t *
+prim_apply(sn_t *S, obj_t *prim, int argc, obj_t **argv)
+{
+  if (!PRIM_ARITY_P(prim, argc)) {
+    arity_error(S, prim, argc);
+  }
+  return prim->prim.func(S, argc, argv);
+}
+
+/**
+ * The frame for applying closure `clos` to the newest `n` Args, which
+ * the caller pops once it has the frame.
+ */
 static obj_t *
-env_extend(sn_t *S, obj_t *env, obj_t *names, obj_t *values)
+env_extend(sn_t *S, obj_t *clos, int n)
 {
+  obj_t *frame, **slot;
+#ifdef TRACE_DEBUG
+  int i;
+#endif
 
 #ifdef TRACE_DEBUG
-  fprintf(stderr, "%d, %d\n\t", length(S, names), length(S, values));
-  print_object(S, stderr, names);
-  fputs(", ", stderr);
-  print_object(S, stderr, values);
+  fprintf(stderr, "%d, %d\n\t", clos->clos.arity, n);
+  print_object(S, stderr, clos->clos.code->code.params);
+  fputs(",", stderr);
+  for (i = S->Args_index - n; i < S->Args_index; i++) {
+    fputc(' ', stderr);
+    print_object(S, stderr, S->Args[i]);
+  }
   fputc('\n', stderr);
 #endif
 
-  if (length(S, names) == length(S, values)) {
-    return cons(S, cons(S, names, values), env);
+  if (n != clos->clos.arity) {
+    fprintf(stderr, "FATAL: Too few names, or values in extend\n");
+    exit(1);
   }
-  fprintf(stderr, "FATAL: Too few names, or values in extend\n");
-  exit(1);
+
+  PROFILE_COUNT(S, envs);
+  GC_PROTECT(S, clos);
+  frame = mk_frame(S, clos->clos.env, clos->clos.code->code.params, n);
+  GC_UNPROTECT(S, 1);
+
+  /* Args are roots, so a collection in mk_frame kept them current */
+  slot = FRAME_SLOTS(frame);
+  memcpy(slot, S->Args + S->Args_index - n, n * sizeof(*slot));
+
+  return frame;
 }
 
-static obj_t *
-env_lookup(sn_t *S, obj_t *env, obj_t *sym)
+/**
+ * Toplevel bindings. A symbol that has ever been bound owns a slot in
+ * S->Globals, so reading or setting it doesn't depend on how many
+ * globals there are. Slot 0 is never used, and stays NULL.
+ */
+obj_t *
+global_ref(sn_t *S, obj_t *sym)
 {
-  obj_t *names, *values, *frame;
-
-  while (env != S->NIL && env != NULL) {
-    frame = car(S, env);
-    names = car(S, frame);
-    values = cdr(S, frame);
+  return S->Globals[sym->atom.global];
+}
 
-    while (names != S->NIL) {
-      if (car(S, names) == sym) {
-        return car(S, values);
-      }
-      else {
-        names = cdr(S, names);
-        values = cdr(S, values);
+void
+global_set(sn_t *S, obj_t *sym, obj_t *value)
+{
+  if (sym->atom.global == 0) {
+    if (S->Globals_index >= S->Globals_alloc) {
+      S->Globals_alloc *= 2;
+      S->Globals = realloc(S->Globals, sizeof(*S->Globals) * S->Globals_alloc);
+      if (S->Globals == NULL) {
+        perror("realloc");
+        exit(1);
       }
     }
-
-    env = cdr(S, env);
+    sym->atom.global = S->Globals_index++;
   }
+  S->Globals[sym->atom.global] = value;
+}
 
+/* The name the primitive `func` was installed under, or NULL */
+char *
+prim_name(sn_t *S, obj_t *(*func)(sn_t *, int, obj_t **))
+{
+  module_entry_t *mod;
+  int i, j;
+
+  for (i = 0; i < S->Modules_index; i++) {
+    for (mod = S->Modules[i], j = 0; mod[j].name != NULL; j++) {
+      if (mod[j].func == func) {
+        return mod[j].name;
+      }
+    }
+  }
   return NULL;
 }
 
-static obj_t *
-closure_env(sn_t *S, obj_t *a)
+int
+site_new(sn_t *S, char *name, obj_t *(*prim)(sn_t *, int, obj_t **))
 {
-  if (!a || a->flag != CLOS_T) {
-    fprintf(stderr, "ERROR: Attempt to take environment of non-closure\n");
-    return NULL;
+  site_t *site;
+
+  if (S->Sites_index >= S->Sites_alloc) {
+    S->Sites_alloc = S->Sites_alloc ? S->Sites_alloc * 2 : 64;
+    S->Sites = realloc(S->Sites, sizeof(*S->Sites) * S->Sites_alloc);
+    if (S->Sites == NULL) {
+      perror("realloc");
+      exit(1);
+    }
   }
 
-  if (a->cons.cdr == NULL) {
-    return S->NIL;
+  site = &S->Sites[S->Sites_index];
+  memset(site, 0, sizeof(*site));
+  site->name = strdup(name);
+  site->prim = prim;
+  if (site->name == NULL) {
+    perror("strdup");
+    exit(1);
   }
-  return a->cons.cdr;
+  return S->Sites_index++;
 }
 
-static obj_t *
-closure_params(sn_t *S, obj_t *a)
+/**
+ * The site of `code`, made the first time it is asked for. It is named
+ * after the global holding a closure over the code if there is one, or
+ * else its parameter list. Doesn't allocate.
+ */
+int
+code_site(sn_t *S, obj_t *code)
 {
-  if (!a || a->flag != CLOS_T) {
-    fprintf(stderr, "ERROR: Attempt to take params of non-closure\n");
-    return NULL;
+  obj_t *sym, *value;
+  writer_t w;
+  size_t i;
+
+  if (code->code.site != 0) {
+    return code->code.site;
   }
 
-  return car(S, a->cons.car);
+  for (i = 0; i < S->Symtab_alloc; i++) {
+    sym = S->Symtab[i];
+    if (sym == NULL || sym->atom.global == 0) {
+      continue;
+    }
+    value = S->Globals[sym->atom.global];
+    if (FLAG_P(value, CLOS_T) && value->clos.code == code) {
+      return code->code.site = site_new(S, sym->atom.string.data, NULL);
+    }
+  }
+
+  writer_init(&w, NULL);
+  writer_put(&w, "(fn ", 4);
+  write_object(S, &w, code->code.params);
+  writer_put(&w, ")", 2); /* and the NUL */
+  code->code.site = site_new(S, w.buf, NULL);
+  writer_free(&w);
+
+  return code->code.site;
 }
 
-static obj_t *
-closure_code(sn_t *S, obj_t *a)
+int
+prim_site(sn_t *S, obj_t *(*prim)(sn_t *, int, obj_t **))
 {
-  if (!a || a->flag != CLOS_T) {
-    fprintf(stderr, "ERROR: Attempt to take code of non-closure\n");
-    return NULL;
-  }
+  char *name;
+  int i;
 
-  return cdr(S, a->cons.car);
+  for (i = 2; i < S->Sites_index; i++) {
+    if (S->Sites[i].prim == prim) {
+      return i;
+    }
+  }
+  name = prim_name(S, prim);
+  return site_new(S, name ? name : "(primitive)", prim);
 }
 
 /**
@@ -658,371 +1332,540 @@ closure_code(sn_t *S, obj_t *a)
  *       It should in the future actually use the module facility by
  *       creating a module, and adding the functions, and what not.
  *   
- *       For now, the module gets installed in a new frame in the
- *       Environment.
+ *       For now, the module's entries are bound as globals.
  */
 obj_t *
 module_install(sn_t *S, char *modname, module_entry_t *mod) 
 {
-  obj_t *names, *values, *name, *value;
-  module_entry_t *current;
+  obj_t *name, *value = NULL;
   int i = 0;
 
   if (mod == NULL) {
     return S->NIL;
   }
 
-  names = S->NIL;
-  values = S->NIL;
+  if (S->Modules_index >= MODULES_MAX) {
+    fprintf(stderr, "FATAL: Too many modules\n");
+    exit(1);
+  }
+  S->Modules[S->Modules_index++] = mod;
+
+  GC_PROTECT(S, value);
 
   while (mod[i].name != NULL) {
-    if (mod[i].name == NULL || mod[i].name[0] == ':') {
+    if (mod[i].name[0] == ':') {
       fprintf(stderr, "ERROR: can't bind value to a keyword\n");
+      GC_UNPROTECT(S, 1);
       return NULL;
     }
 
-    name = intern(S, mod[i].name, strlen(mod[i].name));
-    names = cons(S, name, names);
-
     value = mk_prim(S, mod[i].func, mod[i].arity, mod[i].max_arity);
-    values = cons(S, value, values);
+    name = intern(S, mod[i].name, strlen(mod[i].name));
+    global_set(S, name, value);
 
     i++;
   }
 
-  /* TODO: Should really flatten this, but OK for now... */
-  S->Toplevel_Env = env_extend(S, S->Toplevel_Env, names, values);
+  GC_UNPROTECT(S, 1);
 
   return S->NIL;
 }
 
 
-obj_t *
-eval(sn_t *S, obj_t *a, obj_t *env)
+/* The scope matching an existing environment */
+static obj_t *
+env_scope(sn_t *S, obj_t *env)
 {
-#define NEXT(P) op = P; break;
+  obj_t *scope;
 
-  obj_t *ar, *dr;
-  opcode_t op = OP_DISPATCH;
-  if (!a || env->flag != CONS_T) {
-    fprintf(stderr, "ERROR: Attempt to eval with improper arguments\n");
-    print_object(S, stderr, a);
-    return NULL;
+  if (env == S->NIL) {
+    return S->NIL;
   }
 
-  S->Env = env;
-  S->Exp = a;
+  GC_PROTECT(S, env);
+  scope = env_scope(S, env->frame.up);
+  scope = cons(S, env->frame.names, scope);
+  GC_UNPROTECT(S, 1);
 
-  S->Opstack[S->Opstack_index++] = OP_DONE;
+  return scope;
+}
 
-  for (;;) {
-#ifdef TRACE_DEBUG
-    fprintf(stderr, "TRACE: (Evaluating Exp)\n\t -> ");
-    print_object(S, stderr, S->Exp);
-    fputc('\n', stderr);
+/**
+ * With GCC and compatible compilers, every instruction jumps straight
+ * to the code for the next one through a table of label addresses,
+ * instead of going back around the switch. Build with
+ * -DNO_THREADED_DISPATCH to use just the switch.
+ */
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
 #endif
 
-    switch (op) {
-    case OP_DISPATCH:
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_DISPATCH\n");
+#ifdef THREADED_DISPATCH
+#define CASE(o) case o: L_##o
+#define NEXT() \
+  do { \
+    op = insns[pc++]; \
+    TRACE_OP(); \
+    PROFILE_OP(); \
+    ALLOC_OP(); \
+    goto *labels[op]; \
+  } while (0)
+#else
+#define CASE(o) case o
+#define NEXT() break
 #endif
-      if (S->Exp == S->NIL) {
-        S->Val = S->NIL;
-        NEXT(OP_POPJ_RET);
-      }
 
-      if (S->Exp->flag == ATOM_T) {
-        if (S->Exp->atom.flag == KEYWORD_T) {
-          S->Val = S->Exp;
-          NEXT(OP_POPJ_RET);
-        }
-        else if (S->Exp->atom.flag == SYMBOL_T) {
-          S->Val = env_lookup(S, S->Env, S->Exp);
-          if (S->Val == NULL) {
-            /* try the top level */
-            S->Val = env_lookup(S, S->Toplevel_Env, S->Exp);
-            if (S->Val == NULL) {
-              fprintf(stderr, "FATAL: Unknown name: '%s'\n", S->Exp->atom.string.data);
-              exit(1);
-            }
-          }
-          NEXT(OP_POPJ_RET);
-        }
-        else {
-          S->Val = S->Exp;
-          NEXT(OP_POPJ_RET);
-        }
-      }
-      else if (S->Exp->flag == CLOS_T || S->Exp->flag == PRIM_T) {
-        S->Val = S->Exp;
-        NEXT(OP_POPJ_RET);
-      }
-      else if (S->Exp->flag == CONS_T) {
-        ar = car(S, S->Exp);
+/* Val = the local addressed by the next two operands */
+#define LOCAL_REF() \
+  do { \
+    S->Val = S->Env; \
+    for (d = insns[pc++]; d > 0; d--) { \
+      S->Val = S->Val->frame.up; \
+    } \
+    S->Val = FRAME_SLOTS(S->Val)[insns[pc++]]; \
+  } while (0)
 
-        if (ar == S->QUOTE) {
-          S->Val = car(S, cdr(S, S->Exp));
-          NEXT(OP_POPJ_RET);
-        }
-        else if (ar == S->IF) {
-          dr = cdr(S, S->Exp);
-          if (dr->flag == CONS_T) {
-            S->Exp = car(S, dr);
-#if TRACE_DEBUG
-            fprintf(stderr, "Going to evaluate: ");
-            print_object(S, stderr, S->Exp);
-            fputc('\n', stderr);
-#endif
-            
-            S->Clink = cons(S, S->Env, S->Clink);
-            S->Clink = cons(S, cdr(S, dr), S->Clink);
-
-#if TRACE_DEBUG
-            fprintf(stderr, "Clinking: ");
-            print_object(S, stderr, cdr(S, dr));
-            fputc('\n', stderr);
-#endif
-
-            if (S->Opstack_index < S->Opstack_alloc) {
-              S->Opstack[S->Opstack_index++] = OP_IF_DECIDE;
-            }
-            else {
-              fprintf(stderr, "FATAL: Stack overflow in eval, OP_DISPATCH\n");
-              exit(1);
-            }
-          }
-          else {
-            fprintf(stderr, "FATAL: Syntax error at 'if'\n");
-            exit(1);
-          }
-
-          NEXT(OP_DISPATCH);
-        }
-        else if (ar == S->FN) {
-          dr = cdr(S, S->Exp);
-          if (dr && dr->flag == CONS_T) {
-            ar = car(S, dr);
-            if (ar && ar->flag == CONS_T) {
-              S->Val = mk_clos(S, dr, S->Env);
-            }
-            else {
-              fprintf(stderr, "FATAL: Syntax error in fn declaration\n");
-              exit(1);
-            }
-          }
-          else {
-            fprintf(stderr, "FATAL: Syntax error in fn declaration\n");
-            exit(1);
-          }
-          NEXT(OP_POPJ_RET);
-        }
-        else if (cdr(S, S->Exp) == S->NIL) {
-          if (S->Opstack_index < S->Opstack_alloc) {
-            S->Opstack[S->Opstack_index++] = OP_APPLY_NO_ARGS;
-          }
-          else {
-            fprintf(stderr, "FATAL: Stack overflow in eval, OP_DISPATCH\n");
-            exit(1);
-          }
-
-          S->Exp = car(S, S->Exp);
-        }
-        else {
-          S->Clink = cons(S, S->Env, S->Clink);
-          S->Clink = cons(S, S->Exp, S->Clink);
-
-          if (S->Opstack_index < S->Opstack_alloc) {
-            S->Opstack[S->Opstack_index++] = OP_ARGS;
-          }
-          else {
-            fprintf(stderr, "FATAL: Stack overflow in eval, OP_DISPATCH\n");
-            exit(1);
-          }
-
-          S->Exp = car(S, S->Exp);
-        }
+static void
+unbound(obj_t *sym)
+{
+  fprintf(stderr, "FATAL: Unknown name: '%s'\n", sym->atom.string.data);
+  exit(1);
+}
 
-        NEXT(OP_DISPATCH);
-      }
+/* Makes room for one more frame on the stack, and returns it */
+static cont_t *
+stack_push(sn_t *S, opcode_t op)
+{
+  cont_t *k;
 
-      fprintf(stderr, "FATAL: Got to end of dispatch, and did nothing.\n");
+  if (S->Stack_index >= S->Stack_alloc) {
+    S->Stack_alloc *= 2;
+    S->Stack = realloc(S->Stack, sizeof(*S->Stack) * S->Stack_alloc);
+    if (S->Stack == NULL) {
+      perror("realloc");
       exit(1);
+    }
+  }
 
-    case OP_IF_DECIDE:
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_IF_DECIDE\n");
-#endif
-      S->Exp = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
-
-      S->Env = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
-
-      if (S->Val == S->NIL) {
-        S->Exp = cdr(S, S->Exp);
-      }
-      else {
-        S->Exp = car(S, S->Exp);
-      }
-      NEXT(OP_DISPATCH);
-
-    case OP_APPLY_NO_ARGS:
-
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_APPLY_NO_ARGS\n");
-#endif
-
-      S->Args = S->NIL;
-      NEXT(OP_APPLY);
+  PROFILE_COUNT(S, frames);
+  k = &S->Stack[S->Stack_index++];
+  k->op = op;
+  k->pc = 0;
+  k->code = S->NIL;
+  k->env = S->NIL;
+  k->fn = S->NIL;
+  return k;
+}
 
-    case OP_ARGS:
+/* Pushes `o` onto Args, making room for it if need be */
+static void
+args_push(sn_t *S, obj_t *o)
+{
+  if (S->Args_index >= S->Args_alloc) {
+    S->Args_alloc *= 2;
+    S->Args = realloc(S->Args, sizeof(*S->Args) * S->Args_alloc);
+    if (S->Args == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  S->Args[S->Args_index++] = o;
+}
 
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_ARGS\n");
+/**
+ * The VM. Compiles `a` and runs the code in the registers: Code and pc
+ * are the instruction being run, Val holds the result of the last one,
+ * and S->Args is a stack of the values for the calls being made. A
+ * call with n arguments takes the newest n, in the order they were
+ * pushed, and pops them: primitives get them in place as argv, and
+ * closures copy them into their frame.
+ *
+ * Whatever has to survive a call is kept in frames on S->Stack, see
+ * cont_t. Saving and restoring them doesn't allocate.
+ */
+obj_t *
+eval(sn_t *S, obj_t *a, obj_t *env)
+{
+#ifdef THREADED_DISPATCH
+  static void *labels[OP_COUNT] = {
+    [OP_CONST] = &&L_OP_CONST,
+    [OP_LOCAL] = &&L_OP_LOCAL,
+    [OP_GLOBAL] = &&L_OP_GLOBAL,
+    [OP_CLOSURE] = &&L_OP_CLOSURE,
+    [OP_FRAME] = &&L_OP_FRAME,
+    [OP_ARG] = &&L_OP_ARG,
+    [OP_CALL] = &&L_OP_CALL,
+    [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+    [OP_JUMP] = &&L_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+    [OP_RETURN] = &&L_OP_RETURN,
+    [OP_DONE] = &&L_OP_DONE,
+    [OP_ARG_LOCAL] = &&L_OP_ARG_LOCAL,
+    [OP_JUMP_UNLESS_LOCAL] = &&L_OP_JUMP_UNLESS_LOCAL,
+    [OP_CALL_GLOBAL] = &&L_OP_CALL_GLOBAL,
+    [OP_TAIL_CALL_GLOBAL] = &&L_OP_TAIL_CALL_GLOBAL,
+    [OP_TAIL_CALL_SELF] = &&L_OP_TAIL_CALL_SELF
+  };
 #endif
-      S->Exp = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
-
-      S->Env = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
+  obj_t *scope, **slot;
+  obj_t *(*prim)(sn_t *, int, obj_t **);
+  int *insns, pc = 0, n, d;
+  opcode_t op;
+  cont_t *k;
 
-      S->Clink = cons(S, S->Val, S->Clink);
+  if (!a || (env != S->NIL && !FLAG_P(env, FRAME_T))) {
+    fprintf(stderr, "ERROR: Attempt to eval with improper arguments\n");
+    print_object(S, stderr, a);
+    return NULL;
+  }
 
-      S->Exp = cdr(S, S->Exp);
-      S->Args = S->NIL;
-      NEXT(OP_ARGS_1);
+  if (sample_pending) {
+    sample_take(S, NULL);
+  }
 
-    case OP_ARGS_1:
+  S->Env = env;
+  S->Exp = a;
+  scope = env_scope(S, S->Env);
+  S->Code = compile(S, S->Exp, scope);
+  insns = CODE_INSNS(S->Code);
+  S->Code->code.site = 1;
 
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_ARGS_1\n");
+#ifdef VM_PROFILE
+  profile_start(S);
 #endif
+  stack_push(S, OP_DONE);
 
-      if (cdr(S, S->Exp) == S->NIL) {
-        S->Clink = cons(S, S->Args, S->Clink);
+  for (;;) {
+    op = insns[pc++];
+    TRACE_OP();
+    PROFILE_OP();
+    ALLOC_OP();
 
-        if (S->Opstack_index < S->Opstack_alloc) {
-          S->Opstack[S->Opstack_index++] = OP_LAST_ARG;
-        }
-        else {
-          fprintf(stderr, "FATAL: Stack overflow in eval, OP_ARGS_1\n");
-          exit(1);
+    switch (op) {
+    CASE(OP_CONST):
+      S->Val = CODE_CONSTS(S->Code)[insns[pc++]];
+      NEXT();
+
+    CASE(OP_LOCAL):
+      LOCAL_REF();
+      NEXT();
+
+    CASE(OP_GLOBAL):
+      S->Val = global_ref(S, CODE_CONSTS(S->Code)[insns[pc]]);
+      if (S->Val == NULL) {
+        unbound(CODE_CONSTS(S->Code)[insns[pc]]);
+      }
+      pc++;
+      NEXT();
+
+    CASE(OP_CLOSURE):
+      S->Val = mk_clos(S, CODE_CONSTS(S->Code)[insns[pc++]], S->Env);
+      insns = CODE_INSNS(S->Code);
+      NEXT();
+
+    CASE(OP_FRAME):
+      k = stack_push(S, OP_FRAME);
+      k->fn = S->Val;
+      NEXT();
+
+    CASE(OP_ARG):
+      args_push(S, S->Val);
+      NEXT();
+
+    CASE(OP_ARG_LOCAL):
+      LOCAL_REF();
+      args_push(S, S->Val);
+      NEXT();
+
+    CASE(OP_JUMP):
+      pc = insns[pc];
+      NEXT();
+
+    CASE(OP_JUMP_UNLESS_LOCAL):
+      LOCAL_REF();
+      /* fall through */
+    CASE(OP_JUMP_IF_FALSE):
+      pc = S->Val == S->NIL ? insns[pc] : pc + 1;
+      NEXT();
+
+    CASE(OP_CALL):
+    CASE(OP_TAIL_CALL):
+      n = insns[pc++];
+      k = &S->Stack[S->Stack_index - 1];
+      S->Val = k->fn;
+      k->fn = S->NIL;
+
+      if (FLAG_P(S->Val, PRIM_T)) {
+        APPLY_PRIM(n);
+        S->Stack_index--;
+        insns = CODE_INSNS(S->Code);
+        if (op == OP_TAIL_CALL) {
+          goto ret;
         }
+        NEXT();
+      }
+      else if (!FLAG_P(S->Val, CLOS_T)) {
+        fprintf(stderr, "FATAL: Attempt to apply a non-function\n");
+        exit(1);
+      }
+
+      if (op == OP_CALL) {
+        k->op = OP_RETURN;
+        k->pc = pc;
+        k->code = S->Code;
+        k->env = S->Env;
       }
       else {
-        S->Clink = cons(S, S->Env, S->Clink);
-        S->Clink = cons(S, S->Exp, S->Clink);
-        S->Clink = cons(S, S->Args, S->Clink);
+        S->Stack_index--;
+      }
 
-        if (S->Opstack_index < S->Opstack_alloc) {
-          S->Opstack[S->Opstack_index++] = OP_ARGS_2;
-        }
-        else {
-          fprintf(stderr, "FATAL: Stack overflow in eval, OP_ARGS_1\n");
-          exit(1);
+      S->Env = env_extend(S, S->Val, n);
+      S->Args_index -= n;
+      goto enter;
+
+    CASE(OP_CALL_GLOBAL):
+    CASE(OP_TAIL_CALL_GLOBAL):
+    CASE(OP_TAIL_CALL_SELF):
+      S->Val = global_ref(S, CODE_CONSTS(S->Code)[insns[pc]]);
+      if (S->Val == NULL) {
+        unbound(CODE_CONSTS(S->Code)[insns[pc]]);
+      }
+      n = insns[pc + 1];
+      pc += 2;
+
+      if (FLAG_P(S->Val, PRIM_T)) {
+        APPLY_PRIM(n);
+        insns = CODE_INSNS(S->Code);
+        if (op != OP_CALL_GLOBAL) {
+          goto ret;
         }
+        NEXT();
+      }
+      else if (!FLAG_P(S->Val, CLOS_T)) {
+        fprintf(stderr, "FATAL: Attempt to apply a non-function\n");
+        exit(1);
       }
-      S->Exp = car(S, S->Exp);
-      NEXT(OP_DISPATCH);
 
-    case OP_ARGS_2:
+      if (op == OP_TAIL_CALL_SELF && S->Val->clos.code == S->Code
+          && S->Val->clos.env == S->Env->frame.up
+          && n == S->Val->clos.arity) {
+        slot = FRAME_SLOTS(S->Env);
+        S->Args_index -= n;
+        for (d = 0; d < n; d++) {
+          slot[d] = S->Args[S->Args_index + d];
+        }
+        GC_WRITE(S, S->Env);
+        pc = 0;
+        SAMPLE_POINT(NULL);
+        NEXT();
+      }
 
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_ARGS_2\n");
+      if (op == OP_CALL_GLOBAL) {
+        k = stack_push(S, OP_RETURN);
+        k->pc = pc;
+        k->code = S->Code;
+        k->env = S->Env;
+      }
+      S->Env = env_extend(S, S->Val, n);
+      S->Args_index -= n;
+
+    enter:
+      S->Code = S->Val->clos.code;
+      insns = CODE_INSNS(S->Code);
+      pc = 0;
+      SAMPLE_POINT(NULL);
+      NEXT();
+
+    CASE(OP_RETURN):
+    ret:
+      k = &S->Stack[--S->Stack_index];
+      if (k->op == OP_DONE) {
+#ifdef VM_PROFILE
+        profile_op(S, OP_DONE); /* counts finished evals */
+#endif
+#ifdef ALLOC_PROFILE
+        S->Alloc_op = OP_COUNT;
 #endif
-      S->Args = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
+        return S->Val;
+      }
+      pc = k->pc;
+      S->Code = k->code;
+      S->Env = k->env;
+      insns = CODE_INSNS(S->Code);
+      NEXT();
 
-      S->Exp = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
+    CASE(OP_DONE):
+    default:
+      fprintf(stderr, "FATAL: Invalid opcode %d\n", op);
+      exit(1);
+    }
+  }
+}
 
-      S->Env = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
-      
-      S->Args = cons(S, S->Val, S->Args);
-      S->Exp = cdr(S, S->Exp);
-      NEXT(OP_ARGS_1);
+/* What run does with each form besides evaluating it */
+#define RUN_PROMPT 1  /* prompt for it */
+#define RUN_PRINT 2   /* print its value */
+#define RUN_TIME 4    /* report how long it took on stderr */
 
-    case OP_LAST_ARG:
+typedef struct timing {
+  int forms;
+  double total;
+  double max;
+} timing_t;
 
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_LAST_ARG\n");
-#endif
-      S->Args = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
+static double
+now_ms(void)
+{
+  struct timespec ts;
 
-      S->Args = cons(S, S->Val, S->Args);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-      S->Val = car(S, S->Clink);
-      S->Clink = cdr(S, S->Clink);
+/* Evaluates every form `r` holds */
+static void
+run(sn_t *S, reader_t *r, int flags, timing_t *t)
+{
+  obj_t *rd, *res;
+  double start, ms;
 
-      NEXT(OP_APPLY);
+  while (!r->eof) {
+    if (flags & RUN_PROMPT) {
+      fputs("lll> ", stdout);
+    }
 
-    case OP_APPLY:
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_APPLY\n");
-#endif
-      if (S->Val && S->Val->flag == PRIM_T) {
-        S->Val = S->Val->prim.func(S, S->Args);
+    rd = read_object(S, r);
+    if (rd == NULL) {
+      continue;
+    }
 
-        NEXT(OP_POPJ_RET);
+    start = (flags & RUN_TIME) ? now_ms() : 0;
+    res = eval(S, rd, S->Env);
+    if (flags & RUN_TIME) {
+      ms = now_ms() - start;
+      t->forms++;
+      t->total += ms;
+      if (ms > t->max) {
+        t->max = ms;
       }
-      else if (S->Val && S->Val->flag == CLOS_T) {
-#ifdef TRACE_DEBUG
-        fprintf(stderr, "TRACE: Apply Closure\n\t params(Val): ");
-        print_object(S, stderr, S->Val);
-        print_object(S, stderr, closure_params(S, S->Val));
-        fputc('\n', stderr);
-#endif
-
-        S->Env = env_extend(S, closure_env(S, S->Val), closure_params(S, S->Val), S->Args);
-        S->Exp = closure_code(S, S->Val);
+      fflush(stdout); /* keep the report in line with the output */
+      fprintf(stderr, "; form %d: %.3f ms\n", t->forms, ms);
+    }
 
-        NEXT(OP_DISPATCH);
-      }
-      /* TODO: Error: unable to apply this */
-    case OP_POPJ_RET:
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_POPJ_RET\n");
-#endif
-      if (S->Opstack_index > 0) {
-        op = S->Opstack[--(S->Opstack_index)];
-      }
-      else {
-        fprintf(stderr, "FATAL: No ops left on the stack\n");
-        exit(1);
-      }
-      break;
-    case OP_DONE:
-#ifdef TRACE_DEBUG
-      fprintf(stderr, "TRACE: OP_DONE\n");
-#endif
-    default:
-      return S->Val;
+    if (res != NULL && (flags & RUN_PRINT)) {
+      fputs("  => ", stdout);
+      print_object(S, stdout, res);
+      fputc('\n', stdout);
     }
   }
+}
 
-  return S->NIL;
+/* One line of key=value pairs on stderr, for bench/run.sh */
+static void
+report_stats(sn_t *S, double start)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  fflush(stdout);
+  fprintf(stderr, "; stats wall_ms=%.3f alloc_bytes=%lu minor_gcs=%d"
+          " major_gcs=%d max_rss_kb=%ld\n",
+          now_ms() - start, (unsigned long)gc_allocated(S),
+          S->Gc_minors, S->Gc_majors, ru.ru_maxrss);
 }
 
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: lll [-qst] [-i image] [-p out] [-e expr]... [file | -]\n"
+          "  -i image  start from a heap image made by save-image\n"
+          "  -e expr   evaluate expr and print its value\n"
+          "  -p out    write a sampled profile to out, as folded stacks\n"
+          "  -q        don't prompt or print values\n"
+          "  -s        report time, allocation and memory use on exit\n"
+          "  -t        report the time each form takes on stderr\n"
+          "The forms in file, or on stdin for -, are evaluated without\n"
+          "printing their values. Without a file or -e, lll prompts for\n"
+          "forms on stdin.\n");
+  exit(1);
+}
 
 int
 main(int argc, char **argv)
 {
   sn_t S;
-  obj_t *rd, *res;
+  reader_t r;
+  timing_t t;
+  char *image = NULL, *profile = NULL, **exprs;
+  int opt, quiet = 0, timed = 0, stats = 0, nexprs = 0, i, flags;
+  double start = now_ms();
+
+  exprs = malloc(sizeof(*exprs) * argc);
+  if (exprs == NULL) {
+    perror("malloc");
+    exit(1);
+  }
 
-  S.NIL = cons(&S, NULL, NULL);
-  S.Toplevel_Env = S.NIL; /* this should more or less be the module */
+  while ((opt = getopt(argc, argv, "e:i:p:qst")) != -1) {
+    switch (opt) {
+    case 'e':
+      exprs[nexprs++] = optarg;
+      break;
+    case 'i':
+      image = optarg;
+      break;
+    case 'p':
+      profile = optarg;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 's':
+      stats = 1;
+      break;
+    case 't':
+      timed = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind > 1) {
+    usage();
+  }
+
+  memset(&S, 0, sizeof(S)); /* the collector scans every register */
+  gc_init(&S);
+  site_new(&S, "(outside the VM)", NULL);
+  site_new(&S, "(toplevel)", NULL);
+#ifdef ALLOC_PROFILE
+  S.Alloc_op = OP_COUNT;
+#endif
+  S.NIL = IMM_NIL;
+  S.Globals = calloc(GLOBALS_INIT_SIZE, sizeof(*S.Globals));
+  if (S.Globals == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  S.Globals_alloc = GLOBALS_INIT_SIZE;
+  S.Globals_index = 1;
   S.Env = S.NIL;
   S.Exp = S.NIL;
   S.Val = S.NIL;
-  S.Clink = S.NIL;
-  S.Opstack = malloc(sizeof(*S.Opstack) * OPSTACK_INIT_SIZE);
-  S.Opstack_alloc = OPSTACK_INIT_SIZE;
-  S.Opstack_index = 0;
-  S.Args = S.NIL;
+  S.Stack = malloc(sizeof(*S.Stack) * STACK_INIT_SIZE);
+  if (S.Stack == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  S.Stack_alloc = STACK_INIT_SIZE;
+  S.Stack_index = 0;
+  S.Args = malloc(sizeof(*S.Args) * STACK_INIT_SIZE);
+  if (S.Args == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  S.Args_alloc = STACK_INIT_SIZE;
+  S.Args_index = 0;
   S.Symtab = NULL;
   S.Symtab_index = 0;
   S.Symtab_alloc = 0;
@@ -1030,28 +1873,68 @@ main(int argc, char **argv)
   S.FN = intern(&S, "fn", 2);
   S.IF = intern(&S, "if", 2);
   S.QUOTE = intern(&S, "quote", 5);
+  S.TRUE = intern(&S, ":true", 5);
 
   install_builtins(&S);
+  install_vectors(&S);
+  install_hashes(&S);
+  install_strings(&S);
 
-  while (!feof(stdin)) {
-    fputs("lll> ", stdout);
-    
-    rd = read_object(&S, stdin);
-    if (rd == NULL) {
-      fflush(stdin);
+  if (image != NULL && image_load(&S, image) != 0) {
+    perror(image);
+    exit(1);
+  }
+
+  if (profile != NULL) {
+    sample_start(&S, profile);
+  }
+
+  memset(&t, 0, sizeof(t));
+  flags = timed ? RUN_TIME : 0;
+
+  for (i = 0; i < nexprs; i++) {
+    reader_string(&r, exprs[i], strlen(exprs[i]));
+    run(&S, &r, flags | (quiet ? 0 : RUN_PRINT), &t);
+    reader_close(&r);
+  }
+
+  if (optind < argc) {
+    if (strcmp(argv[optind], "-") == 0) {
+      reader_init(&r, 0);
     }
-    else {
-      res = eval(&S, rd, S.Env);
-      if (res != NULL) {
-        fputs("  => ", stdout);
-        print_object(&S, stdout, res);
-        fputc('\n', stdout);
-      }
-      else {
-        fflush(stdin);
-      }
+    else if (reader_open(&r, argv[optind]) != 0) {
+      perror(argv[optind]);
+      exit(1);
     }
+    run(&S, &r, flags, &t);
+    reader_close(&r);
+  }
+  else if (nexprs == 0) {
+    reader_init(&r, 0);
+    run(&S, &r, flags | (quiet ? 0 : RUN_PROMPT | RUN_PRINT), &t);
+    reader_close(&r);
+  }
+
+  if (timed) {
+    fprintf(stderr, "; %d forms, %.3f ms total, %.3f ms max\n",
+            t.forms, t.total, t.max);
+  }
+  if (stats) {
+    report_stats(&S, start);
+  }
+#ifdef VM_PROFILE
+  fflush(stdout);
+  vm_profile_dump(&S, stderr);
+#endif
+#ifdef ALLOC_PROFILE
+  fflush(stdout);
+  alloc_profile_dump(&S, stderr);
+#endif
+
+  if (profile != NULL) {
+    sample_stop(); /* before S goes away */
   }
 
+  free(exprs);
   return 0;
 }
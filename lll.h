@@ -1,25 +1,87 @@
 #ifndef LLL_H_
 #define LLL_H_
 
-#define SYMTAB_INIT_SIZE 8
-#define OPSTACK_INIT_SIZE 1024
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __LP64__
+typedef uint64_t sn_ptr_t;
+typedef int64_t sn_int_t;
+#define SN_INT_BITS 63
+#else
+typedef uint32_t sn_ptr_t;
+typedef int32_t sn_int_t;
+#define SN_INT_BITS 31
+#endif
+
+#define SYMTAB_INIT_SIZE 64 /* must be a power of 2 */
+#define STRINGS_BLOCK_SIZE (1 << 14)
+#define STACK_INIT_SIZE 256
+#define HEAP_INIT_SIZE (1 << 20)
+#define HEAP_CHUNK_SIZE (1 << 18)
+#define ROOTS_INIT_SIZE 64
+#define GLOBALS_INIT_SIZE 64
+#define MODULES_MAX 16
+#define SAMPLE_HZ 100
+#define SAMPLE_DEPTH 128
+#define CODE_INIT_SIZE 32
+#define READER_BUFFER_SIZE (1 << 16)
+#define READER_TOKEN_SIZE 256
+#define WRITER_BUFFER_SIZE (1 << 16)
+#define WRITER_STACK_SIZE 64
+
+#define GC_ALIGN(n) (((n) + 7) & ~(size_t)7)
 
 typedef struct sn sn_t;
 typedef struct atom atom_t;
 typedef struct cons cons_t;
 typedef struct prim prim_t;
+typedef struct clos clos_t;
+typedef struct frame frame_t;
+typedef struct code code_t;
+typedef struct vector vector_t;
+typedef struct hash hash_t;
+typedef struct builder builder_t;
+typedef struct cont cont_t;
+typedef struct reader reader_t;
+typedef struct writer writer_t;
 typedef struct module module_t;
 typedef struct module_entry module_entry_t;
 typedef struct obj obj_t;
+typedef struct chunk chunk_t;
 
-#define ISNIL(a) (a.car == NULL && a.cdr == NULL)
+/**
+ * Immediates are encoded in the pointer itself. Heap objects are at
+ * least 8-byte aligned, so a set low bit marks a fixnum, stored shifted
+ * left by one, and a low `10` marks one of the small constants below.
+ * Fixnums that don't fit in SN_INT_BITS are boxed as FIXNUM_T atoms.
+ */
+#define IMM_NIL ((obj_t *)2)
+#define IMM_DELETED ((obj_t *)6) /* a removed key in a hash table, see hash.c */
+
+#define IMMEDIATE_P(o) (((sn_ptr_t)(o) & 3) != 0)
+#define FIXNUM_P(o) (((sn_ptr_t)(o) & 1) != 0)
+#define FIXNUM_VAL(o) ((sn_int_t)(sn_ptr_t)(o) >> 1)
+#define MK_FIXNUM(n) ((obj_t *)(((sn_ptr_t)(n) << 1) | 1))
+#define FIXNUM_MAX (((sn_int_t)1 << (SN_INT_BITS - 1)) - 1)
+#define FIXNUM_MIN (-FIXNUM_MAX - 1)
+
+/* true for heap objects of the given flag_t, false for immediates */
+#define FLAG_P(o, f) ((o) != NULL && !IMMEDIATE_P(o) && (o)->flag == (f))
 
 typedef enum flag {
   ATOM_T,
   CONS_T,
   CLOS_T,
   PRIM_T,
-  MODULE_T
+  MODULE_T,
+  FRAME_T,
+  CODE_T,
+  VECTOR_T,
+  HASH_T,
+  BUILDER_T,
+  FORWARD_T /* left behind in from-space by the collector */
 } flag_t;
 
 typedef enum atom_flag {
@@ -30,21 +92,84 @@ typedef enum atom_flag {
   KEYWORD_T
 } atom_flag_t;
 
+/* Bytecode instructions, with their operands. See compile.c */
 typedef enum opcode {
-  OP_DISPATCH,
-  OP_DONE,
-  OP_POPJ_RET,
-  OP_IF_DECIDE,
-  OP_APPLY_NO_ARGS,
-  OP_ARGS,
-  OP_ARGS_1,
-  OP_ARGS_2,
-  OP_LAST_ARG,
-  OP_APPLY
+  OP_CONST,         /* k: Val = constant k */
+  OP_LOCAL,         /* depth index: Val = slot of an enclosing frame */
+  OP_GLOBAL,        /* k: Val = toplevel value of the symbol constant k */
+  OP_CLOSURE,       /* k: Val = closure of code constant k over Env */
+  OP_FRAME,         /* save the function in Val */
+  OP_ARG,           /* push Val onto Args */
+  OP_CALL,          /* n: apply the saved function to the newest n Args */
+  OP_TAIL_CALL,     /* n: same, replacing the current call */
+  OP_JUMP,          /* addr */
+  OP_JUMP_IF_FALSE, /* addr: jump if Val is () */
+  OP_RETURN,
+  OP_DONE,          /* bottom of the stack for one call to eval */
+
+  /* superinstructions */
+  OP_ARG_LOCAL,         /* depth index: OP_LOCAL, OP_ARG */
+  OP_JUMP_UNLESS_LOCAL, /* depth index addr: jump if the local is () */
+  OP_CALL_GLOBAL,       /* k n: apply global k to the newest n Args */
+  OP_TAIL_CALL_GLOBAL,  /* k n: same, replacing the current call */
+  OP_TAIL_CALL_SELF,    /* k n: same, reusing the frame if k is this code */
+  OP_COUNT
 } opcode_t;
 
+/**
+ * What the VM spent on each opcode, in a -DVM_PROFILE build. Time is
+ * only measured with -DVM_PROFILE_TICKS, in cycles where the CPU has
+ * a counter and nanoseconds otherwise.
+ */
+typedef struct op_profile {
+  unsigned long count;
+  unsigned long bytes;  /* allocated while running it */
+  unsigned long frames; /* pushed onto S->Stack */
+  unsigned long envs;   /* environment frames made */
+  unsigned long long ticks;
+} op_profile_t;
+
+/* Kinds of object counted by a -DALLOC_PROFILE build */
+typedef enum alloc_kind {
+  ALLOC_CONS,
+  ALLOC_FIXNUM,
+  ALLOC_FLONUM,
+  ALLOC_STRING,
+  ALLOC_SYMBOL,
+  ALLOC_CLOSURE,
+  ALLOC_FRAME,
+  ALLOC_CODE,
+  ALLOC_PRIM,
+  ALLOC_VECTOR,
+  ALLOC_HASH,
+  ALLOC_BUILDER,
+  ALLOC_KINDS
+} alloc_kind_t;
+
+typedef struct alloc_count {
+  unsigned long count;
+  unsigned long bytes;
+} alloc_count_t;
+
+/**
+ * Where the profilers say time or memory went: a primitive, or the
+ * closures over one code object. Site 0 is everything done outside
+ * the VM (reading and compiling), and site 1 the toplevel forms.
+ */
+typedef struct site {
+  char *name;
+  obj_t *(*prim)(sn_t *S, int argc, obj_t **argv); /* NULL for code */
+#ifdef ALLOC_PROFILE
+  alloc_count_t kinds[ALLOC_KINDS];  /* allocated while it ran */
+#endif
+} site_t;
+
 struct atom {
   atom_flag_t flag;
+  union {
+    int global; /* a symbol's index into S->Globals, 0 if it has none */
+    int slice;  /* nonzero for a string sharing another's bytes */
+  };
   union {
     long fixnum;
     double flonum;
@@ -55,63 +180,287 @@ struct atom {
   };
 };
 
+/**
+ * A string's bytes follow the object, with a NUL after them. A slice
+ * is followed by the string whose bytes it points into instead, and
+ * has no NUL of its own. That string is never a slice itself.
+ */
+#define STRING_PARENT(o) (*(obj_t **)((o) + 1))
+
 struct cons {
   obj_t *car;
   obj_t *cdr;
 };
 
+/**
+ * A primitive gets its arguments in argv, in the order they were
+ * passed. eval has already checked argc against the arity, and argv
+ * stays a GC root, kept up to date, until the primitive returns.
+ */
 struct prim {
-  obj_t *(*func)(sn_t *S, obj_t *a);
+  obj_t *(*func)(sn_t *S, int argc, obj_t **argv);
   int arity; /* minimum number of args for application. */
   int max_arity; /* maximum number of args for this function
                     -1 is unlimited */
 };
 
+struct clos {
+  obj_t *code; /* a CODE_T */
+  obj_t *env;
+  int arity;   /* number of params, copied from the code */
+};
+
+struct frame {
+  obj_t *up;    /* frame of the enclosing closure, or NIL */
+  obj_t *names; /* the params, for building a scope from an env */
+  int length;   /* followed by this many slots, see FRAME_SLOTS */
+};
+
+#define FRAME_SLOTS(o) ((obj_t **)((o) + 1))
+
+struct code {
+  obj_t *params; /* names for the frames of closures over this code */
+  int arity;
+  int nconsts;   /* followed by this many constants, then the insns */
+  int length;
+  int site;      /* in S->Sites, or 0 until a profiler needs it */
+};
+
+#define CODE_CONSTS(o) ((obj_t **)((o) + 1))
+#define CODE_INSNS(o) ((int *)(CODE_CONSTS(o) + (o)->code.nconsts))
+
+/* Element types of a VECTOR_T. See vector.c */
+typedef enum vec_type {
+  VEC_I64,
+  VEC_F64
+} vec_type_t;
+
+struct vector {
+  vec_type_t type;
+  long length; /* followed by this many unboxed elements */
+};
+
+#define VECTOR_I64(o) ((int64_t *)((o) + 1))
+#define VECTOR_F64(o) ((double *)((o) + 1))
+
+/**
+ * An open-addressing hash map, see hash.c. Its tables are FRAME_Ts of
+ * key, value pairs, which the collector already knows how to scan.
+ */
+struct hash {
+  obj_t *table; /* where new keys go */
+  obj_t *old;   /* the table being moved into it while resizing, or NIL */
+  int count;    /* keys in both tables */
+  int moved;    /* pairs of old before this one have been moved */
+};
+
+/* A string being appended to, see string.c */
+struct builder {
+  obj_t *bytes; /* a STRING_T, as long as the room there is */
+  long length;  /* how much of it has been filled in */
+};
+
+/**
+ * A frame of the evaluator's stack. OP_FRAME frames hold the function
+ * while a call's arguments are evaluated, and become
+ * OP_RETURN frames, saving the caller's registers, while a closure
+ * runs. OP_DONE marks where a call to eval started.
+ */
+struct cont {
+  opcode_t op;
+  int pc;
+  obj_t *code;
+  obj_t *env;
+  obj_t *fn;
+};
+
 struct module_entry {
   char *name;
-  obj_t *(*func)(sn_t *, obj_t *);  
+  obj_t *(*func)(sn_t *, int, obj_t **);
   int arity;
   int max_arity;
 };
 
+/**
+ * Source text for read_object. A file is mapped whole; anything else
+ * is read into a buffer that is refilled as it runs out. Tokens are
+ * collected in `tok`, which grows, so they can be any length.
+ */
+struct reader {
+  char *buf;
+  char *pos;
+  char *end;
+  size_t alloc;     /* size of buf, or 0 if it is mapped */
+  int fd;           /* to refill from, or -1 */
+  int eof;          /* set once reading ran into the end */
+  char *tok;        /* scratch space for the token being read */
+  size_t tok_alloc;
+};
+
+/* Output for write_object, see print.c */
+struct writer {
+  char *buf;
+  size_t len;
+  size_t alloc;
+  FILE *out;          /* where a full buffer goes, or NULL to grow it */
+  obj_t **stack;      /* the rest of each list being written */
+  size_t stack_alloc;
+  size_t depth;
+};
+
+#define GC_REMEMBERED 1
+
 struct obj {
   flag_t flag;
+  unsigned int gcflags; /* only meaningful outside the nursery */
   union {
     atom_t atom;
     cons_t cons;
     prim_t prim;
+    clos_t clos;
+    frame_t frame;
+    code_t code;
+    vector_t vector;
+    hash_t hash;
+    builder_t builder;
   };
 };
 
 struct sn {
   obj_t *NIL;
-  obj_t *Toplevel_Env;
   obj_t *Env;
   obj_t *Exp;
-  obj_t *Clink;
+  obj_t *Code; /* the CODE_T being run by eval */
   obj_t *Val;
-  obj_t *Args;
   obj_t *FN;
   obj_t *IF;
   obj_t *QUOTE;
+  obj_t *TRUE;
   obj_t **Symtab;
   size_t Symtab_alloc;
   int Symtab_index;
-  opcode_t *Opstack;
-  size_t Opstack_alloc;
-  int Opstack_index;
+  obj_t **Globals;     /* toplevel values, NULL if unbound */
+  size_t Globals_alloc;
+  int Globals_index;
+  module_entry_t *Modules[MODULES_MAX]; /* installed, to name primitives */
+  int Modules_index;
+  char *Strings_next; /* arena holding the names of interned symbols */
+  char *Strings_limit;
+  cont_t *Stack;
+  size_t Stack_alloc;
+  int Stack_index;
+  obj_t **Args; /* arguments of the calls being made, newest last */
+  size_t Args_alloc;
+  int Args_index;
+  chunk_t *Nursery;
+  char *Heap_next;     /* bump pointer into the nursery */
+  char *Heap_limit;
+  chunk_t *Heap;       /* chunks of the old space, oldest first */
+  chunk_t *Heap_chunk; /* the old space chunk being filled */
+  char *Old_next;
+  char *Old_limit;
+  chunk_t *Heap_free;  /* evacuated chunks, kept for reuse */
+  size_t Heap_free_size;
+  size_t Heap_allocated;
+  size_t Heap_threshold;
+  int Heap_space;
+  size_t Gc_allocated; /* bytes allocated before the last collection */
+  int Gc_minors;
+  int Gc_majors;
+  obj_t ***Roots;
+  size_t Roots_alloc;
+  int Roots_index;
+  char *Image;         /* objects loaded from an image, see image.c */
+  char *Image_end;
+  obj_t **Remembered;  /* old objects that may point into the nursery */
+  size_t Remembered_alloc;
+  int Remembered_index;
+  obj_t ***Remembered_slots; /* single slots of old objects that do */
+  size_t Remembered_slots_alloc;
+  int Remembered_slots_index;
+  site_t *Sites;
+  int Sites_index;
+  int Sites_alloc;
+#ifdef ALLOC_PROFILE
+  alloc_count_t Alloc[OP_COUNT + 1][ALLOC_KINDS]; /* OP_COUNT: outside */
+  int Alloc_op;         /* the instruction being run, or OP_COUNT */
+  obj_t *(*Alloc_prim)(sn_t *, int, obj_t **); /* the primitive being run */
+#endif
+#ifdef VM_PROFILE
+  op_profile_t Profile[OP_COUNT];
+  opcode_t Profile_op;  /* the instruction being run */
+  size_t Profile_bytes; /* gc_allocated when it started */
+  unsigned long long Profile_ticks;
+#endif
 };
 
+/* Keeps a local obj_t * valid across calls that may collect */
+#define GC_PROTECT(S, v) gc_protect((S), &(v))
+#define GC_UNPROTECT(S, n) ((S)->Roots_index -= (n))
+
+/**
+ * The allocation fast path is a bump of Heap_next within the current
+ * chunk; gc_reserve is only called when the chunk is used up.
+ */
+#ifdef GC_STRESS
+#define GC_ROOM(S, n) 0
+#else
+#define GC_ROOM(S, n) ((S)->Heap_next + (n) <= (S)->Heap_limit)
+#endif
+#define GC_YOUNG(S, o) \
+  ((uintptr_t)(o) - (uintptr_t)(S)->Nursery < HEAP_CHUNK_SIZE)
+#define GC_IMAGE(S, o) \
+  ((uintptr_t)(o) - (uintptr_t)(S)->Image < (uintptr_t)((S)->Image_end - (S)->Image))
+
+/* Must follow every store of an object into an existing one */
+#define GC_WRITE(S, o) \
+  do { \
+    if (!GC_YOUNG(S, o) && !((o)->gcflags & GC_REMEMBERED)) { \
+      gc_remember((S), (o)); \
+    } \
+  } while (0)
+
+/**
+ * Can follow a store into one slot of an existing object instead, so
+ * that a minor collection only looks at that slot. Meant for big
+ * objects that are written a few slots at a time, like hash tables.
+ */
+#define GC_WRITE_SLOT(S, o, slot) \
+  do { \
+    if (!GC_YOUNG(S, o) && GC_YOUNG(S, *(slot))) { \
+      gc_remember_slot((S), (slot)); \
+    } \
+  } while (0)
+
+#define GC_BUMP(S, n) ((void *)(((S)->Heap_next += (n)) - (n)))
+#define GC_ALLOC(S, n) (GC_ROOM(S, n) ? GC_BUMP(S, n) : gc_alloc((S), (n)))
+
+void writer_init(writer_t *w, FILE *out);
+void writer_put(writer_t *w, const char *s, size_t n);
+void writer_flush(writer_t *w);
+void writer_free(writer_t *w);
+void write_object(sn_t *S, writer_t *w, obj_t *o);
 void print_object(sn_t *S, FILE *out, obj_t *o);
-obj_t *read_object(sn_t *S, FILE *in);
+obj_t *print_to_string(sn_t *S, obj_t *o);
+void reader_init(reader_t *r, int fd);
+int reader_open(reader_t *r, char *path);
+void reader_string(reader_t *r, char *s, size_t len);
+void reader_close(reader_t *r);
+obj_t *read_object(sn_t *S, reader_t *r);
 
 obj_t *mk_fixnum(sn_t *S, long d);
 obj_t *mk_flonum(sn_t *S, double d);
 obj_t *mk_str(sn_t *S, char *str, size_t len);
+obj_t *mk_slice(sn_t *S, obj_t *str, size_t start, size_t len);
 obj_t *mk_sym(sn_t *S, char *str, size_t len, int keywordp);
 obj_t *intern(sn_t *S, char *str, size_t len);
+size_t string_hash(char *str, size_t len);
 obj_t *mk_clos(sn_t *S, obj_t *code, obj_t *env);
-obj_t *mk_prim(sn_t *S, obj_t *(*func)(sn_t *, obj_t *),
+obj_t *mk_frame(sn_t *S, obj_t *up, obj_t *names, int length);
+obj_t *mk_vector(sn_t *S, vec_type_t type, long length);
+obj_t *mk_hash(sn_t *S, int capacity);
+obj_t *mk_builder(sn_t *S, size_t capacity);
+obj_t *mk_prim(sn_t *S, obj_t *(*func)(sn_t *, int, obj_t **),
                int minarity, int maxarity);
 obj_t *mk_module(sn_t *S, module_entry_t *entries);
 
@@ -120,10 +469,53 @@ obj_t *car(sn_t *S, obj_t *a);
 obj_t *cdr(sn_t *S, obj_t *a);
 int length(sn_t *S, obj_t *a);
 
+obj_t *compile(sn_t *S, obj_t *exp, obj_t *scope);
 obj_t *eval(sn_t *S, obj_t *a, obj_t *env);
+obj_t *prim_apply(sn_t *S, obj_t *prim, int argc, obj_t **argv);
 
+#ifdef ALLOC_PROFILE
+void alloc_profile(sn_t *S, alloc_kind_t kind, size_t size);
+void alloc_profile_dump(sn_t *S, FILE *out);
+void alloc_profile_reset(sn_t *S);
+#define ALLOC_PROFILE_COUNT(S, kind, size) alloc_profile((S), (kind), (size))
+#else
+#define ALLOC_PROFILE_COUNT(S, kind, size)
+#endif
+#ifdef VM_PROFILE
+void vm_profile_dump(sn_t *S, FILE *out);
+void vm_profile_reset(sn_t *S);
+#endif
+obj_t *global_ref(sn_t *S, obj_t *sym);
+void global_set(sn_t *S, obj_t *sym, obj_t *value);
+
+char *prim_name(sn_t *S, obj_t *(*func)(sn_t *, int, obj_t **));
+int site_new(sn_t *S, char *name,
+             obj_t *(*prim)(sn_t *, int, obj_t **));
+int code_site(sn_t *S, obj_t *code);
+int prim_site(sn_t *S, obj_t *(*prim)(sn_t *, int, obj_t **));
 obj_t *module_install(sn_t *S, char *name, module_entry_t *);
 
 void install_builtins(sn_t *S);
+void install_vectors(sn_t *S);
+void install_hashes(sn_t *S);
+void install_strings(sn_t *S);
+
+extern volatile sig_atomic_t sample_pending;
+void sample_start(sn_t *S, char *path);
+void sample_take(sn_t *S, obj_t *(*prim)(sn_t *, int, obj_t **));
+void sample_stop(void);
+
+int image_save(sn_t *S, char *path);
+int image_load(sn_t *S, char *path);
+
+void gc_init(sn_t *S);
+void gc_collect(sn_t *S);
+void gc_reserve(sn_t *S, size_t size);
+void *gc_alloc(sn_t *S, size_t size);
+void gc_protect(sn_t *S, obj_t **root);
+void gc_remember(sn_t *S, obj_t *o);
+void gc_remember_slot(sn_t *S, obj_t **slot);
+size_t obj_size(obj_t *o);
+size_t gc_allocated(sn_t *S);
 
 #endif
@@ -0,0 +1,343 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "lll.h"
+
+/**
+ * The printer.
+ *
+ * Output is collected in a writer_t, which hands it to its FILE a
+ * buffer at a time, or keeps growing when it has none, for printing
+ * into a string. Lists are walked with an explicit stack of the
+ * rest of each list being printed, so nesting only costs memory.
+ */
+
+static void
+writer_grow(writer_t *w, size_t need)
+{
+  while (w->alloc < w->len + need) {
+    w->alloc *= 2;
+  }
+  w->buf = realloc(w->buf, w->alloc);
+  if (w->buf == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+}
+
+void
+writer_init(writer_t *w, FILE *out)
+{
+  w->buf = malloc(WRITER_BUFFER_SIZE);
+  if (w->buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  w->len = 0;
+  w->alloc = WRITER_BUFFER_SIZE;
+  w->out = out;
+  w->stack = NULL;
+  w->stack_alloc = 0;
+  w->depth = 0;
+}
+
+void
+writer_flush(writer_t *w)
+{
+  if (w->out != NULL && w->len > 0) {
+    fwrite(w->buf, 1, w->len, w->out);
+    w->len = 0;
+  }
+}
+
+void
+writer_free(writer_t *w)
+{
+  writer_flush(w);
+  free(w->buf);
+  free(w->stack);
+}
+
+/* Makes room for `n` more bytes */
+static void
+writer_reserve(writer_t *w, size_t n)
+{
+  writer_flush(w);
+  if (w->len + n > w->alloc) {
+    writer_grow(w, n);
+  }
+}
+
+void
+writer_put(writer_t *w, const char *s, size_t n)
+{
+  if (w->len + n > w->alloc) {
+    if (w->out != NULL && n > w->alloc) {
+      writer_flush(w);
+      fwrite(s, 1, n, w->out);
+      return;
+    }
+    writer_reserve(w, n);
+  }
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+#define WRITER_PUTC(w, ch) \
+  do { \
+    if ((w)->len >= (w)->alloc) { \
+      writer_reserve((w), 1); \
+    } \
+    (w)->buf[(w)->len++] = (ch); \
+  } while (0)
+
+#define WRITER_PUTS(w, s) writer_put((w), (s), sizeof(s) - 1)
+
+static void
+write_long(writer_t *w, long n)
+{
+  char digits[24], *p = digits + sizeof(digits);
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (n < 0) {
+    *--p = '-';
+  }
+  writer_put(w, p, digits + sizeof(digits) - p);
+}
+
+/**
+ * Same output as "%f". Values with at most six decimals whose scaled
+ * form is an exact integer are formatted directly, which covers most
+ * literals; the rest go through snprintf.
+ */
+static void
+write_double(writer_t *w, double d)
+{
+  char digits[64], *p = digits + sizeof(digits);
+  double scaled = d * 1e6;
+  unsigned long long u;
+  int i, n;
+
+  if (scaled > -4503599627370496.0 && scaled < 4503599627370496.0
+      && scaled == (double)(long long)scaled) {
+    u = scaled < 0 ? -(long long)scaled : (long long)scaled;
+    for (i = 0; i < 6; i++) {
+      *--p = '0' + u % 10;
+      u /= 10;
+    }
+    *--p = '.';
+    do {
+      *--p = '0' + u % 10;
+      u /= 10;
+    } while (u != 0);
+    if (d < 0 || (d == 0 && 1 / d < 0)) {
+      *--p = '-';
+    }
+    writer_put(w, p, digits + sizeof(digits) - p);
+    return;
+  }
+
+  n = snprintf(digits, sizeof(digits), "%f", d);
+  if (n >= sizeof(digits)) {
+    /* huge values have every integer digit */
+    if (w->len + n + 1 > w->alloc) {
+      writer_reserve(w, n + 1);
+    }
+    snprintf(w->buf + w->len, n + 1, "%f", d);
+    w->len += n;
+    return;
+  }
+  writer_put(w, digits, n);
+}
+
+static void
+write_atom(writer_t *w, atom_t *a)
+{
+  char *s, *end, *q;
+
+  switch (a->flag) {
+  case FIXNUM_T:
+    write_long(w, a->fixnum);
+    break;
+  case FLONUM_T:
+    write_double(w, a->flonum);
+    break;
+  case KEYWORD_T:
+  case SYMBOL_T:
+    writer_put(w, a->string.data, a->string.length);
+    break;
+  case STRING_T:
+    WRITER_PUTC(w, '"');
+    s = a->string.data;
+    end = s + a->string.length;
+    while ((q = memchr(s, '"', end - s)) != NULL) {
+      writer_put(w, s, q - s);
+      WRITER_PUTS(w, "\\\"");
+      s = q + 1;
+    }
+    writer_put(w, s, end - s);
+    WRITER_PUTC(w, '"');
+    break;
+  }
+}
+
+/* #i64(1 2 3) or #f64(1.000000 2.000000) */
+static void
+write_vector(writer_t *w, obj_t *o)
+{
+  long i;
+
+  if (o->vector.type == VEC_I64) {
+    WRITER_PUTS(w, "#i64(");
+  }
+  else {
+    WRITER_PUTS(w, "#f64(");
+  }
+  for (i = 0; i < o->vector.length; i++) {
+    if (i > 0) {
+      WRITER_PUTC(w, ' ');
+    }
+    if (o->vector.type == VEC_I64) {
+      write_long(w, (long)VECTOR_I64(o)[i]);
+    }
+    else {
+      write_double(w, VECTOR_F64(o)[i]);
+    }
+  }
+  WRITER_PUTC(w, ')');
+}
+
+/* Everything but a non-empty list */
+static void
+write_leaf(sn_t *S, writer_t *w, obj_t *o)
+{
+  if (FIXNUM_P(o)) {
+    write_long(w, (long)FIXNUM_VAL(o));
+    return;
+  }
+  else if (o == S->NIL) {
+    WRITER_PUTS(w, "()");
+    return;
+  }
+
+  switch (o->flag) {
+  case ATOM_T:
+    write_atom(w, &o->atom);
+    break;
+  case CLOS_T:
+    WRITER_PUTS(w, "<#Closure: ");
+    write_object(S, w, o->clos.code->code.params);
+    WRITER_PUTS(w, ">");
+    break;
+  case FRAME_T:
+    WRITER_PUTS(w, "<#Frame ");
+    write_long(w, o->frame.length);
+    WRITER_PUTC(w, '>');
+    break;
+  case CODE_T:
+    WRITER_PUTS(w, "<#Code ");
+    write_long(w, o->code.length);
+    WRITER_PUTC(w, '>');
+    break;
+  case PRIM_T:
+    WRITER_PUTS(w, "<#Primitive>");
+    break;
+  case VECTOR_T:
+    write_vector(w, o);
+    break;
+  case BUILDER_T:
+    WRITER_PUTS(w, "<#Builder ");
+    write_long(w, o->builder.length);
+    WRITER_PUTC(w, '>');
+    break;
+  case HASH_T:
+    WRITER_PUTS(w, "<#Hash ");
+    write_long(w, o->hash.count);
+    WRITER_PUTC(w, '>');
+    break;
+  default:
+    fprintf(stderr, "Invalid object! Aborting\n");
+    exit(1);
+  }
+}
+
+/**
+ * Writes `o` to `w`. Doesn't allocate, so the objects being printed
+ * can't move. An improper tail is printed as a last element.
+ */
+void
+write_object(sn_t *S, writer_t *w, obj_t *o)
+{
+  size_t base = w->depth; /* a closure's params nest inside a list */
+  obj_t *rest;
+
+  for (;;) {
+    /* descend into the first element of each list */
+    while (FLAG_P(o, CONS_T)) {
+      if (w->depth >= w->stack_alloc) {
+        w->stack_alloc = w->stack_alloc ? w->stack_alloc * 2 : WRITER_STACK_SIZE;
+        w->stack = realloc(w->stack, sizeof(*w->stack) * w->stack_alloc);
+        if (w->stack == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      WRITER_PUTC(w, '(');
+      w->stack[w->depth++] = o->cons.cdr;
+      o = o->cons.car;
+    }
+    write_leaf(S, w, o);
+
+    /* move on to the next element, closing finished lists */
+    for (;;) {
+      if (w->depth == base) {
+        return;
+      }
+      rest = w->stack[w->depth - 1];
+      if (rest == S->NIL) {
+        WRITER_PUTC(w, ')');
+        w->depth--;
+        continue;
+      }
+      WRITER_PUTC(w, ' ');
+      if (FLAG_P(rest, CONS_T)) {
+        w->stack[w->depth - 1] = rest->cons.cdr;
+        o = rest->cons.car;
+      }
+      else {
+        w->stack[w->depth - 1] = S->NIL;
+        o = rest;
+      }
+      break;
+    }
+  }
+}
+
+void
+print_object(sn_t *S, FILE *out, obj_t *o)
+{
+  writer_t w;
+
+  writer_init(&w, out);
+  write_object(S, &w, o);
+  writer_free(&w);
+}
+
+/* A string holding what print_object would write */
+obj_t *
+print_to_string(sn_t *S, obj_t *o)
+{
+  writer_t w;
+  obj_t *str;
+
+  writer_init(&w, NULL);
+  write_object(S, &w, o);
+  str = mk_str(S, w.buf, w.len);
+  writer_free(&w);
+
+  return str;
+}
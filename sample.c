@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "lll.h"
+
+/**
+ * The sampling profiler.
+ *
+ * sample_start sets a SIGPROF timer going off SAMPLE_HZ times a second
+ * of CPU time. The handler only sets sample_pending. The VM checks it
+ * whenever it enters a closure or returns from a primitive, which is
+ * cheap enough to leave in, and calls sample_take, which records the
+ * sites being run: the code saved in each OP_RETURN frame on S->Stack,
+ * outermost first, then the current code, then the primitive if there
+ * is one. Only the innermost SAMPLE_DEPTH are kept, which also bounds
+ * the time a sample takes. Samples due while reading or compiling are
+ * taken when eval starts, and charged to site 0.
+ *
+ * Identical chains are counted together, and written by sample_stop,
+ * or at exit, in the folded format that flamegraph.pl reads: one line
+ * per chain, with the names separated by ';', then a space and the
+ * count.
+ */
+
+volatile sig_atomic_t sample_pending = 0;
+
+typedef struct stack_count {
+  int *sites;
+  int depth;
+  size_t hash;
+  unsigned long count;
+} stack_count_t;
+
+/* There is one timer per process, so one sampler */
+static struct sampler {
+  sn_t *S;
+  char *path;
+  stack_count_t *table;
+  size_t alloc;
+  size_t count;
+  int *chain;       /* the sample being taken */
+  int chain_alloc;
+} sampler;
+
+static void
+sample_signal(int sig)
+{
+  sample_pending = 1;
+}
+
+static void
+chain_push(int site, int n)
+{
+  if (n >= sampler.chain_alloc) {
+    sampler.chain_alloc = sampler.chain_alloc ? sampler.chain_alloc * 2 : 64;
+    sampler.chain = realloc(sampler.chain,
+                            sizeof(*sampler.chain) * sampler.chain_alloc);
+    if (sampler.chain == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  sampler.chain[n] = site;
+}
+
+/* FNV-1a over the site numbers */
+static size_t
+chain_hash(int *chain, int n)
+{
+  size_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    h = (h ^ (unsigned)chain[i]) * 16777619u;
+  }
+  return h;
+}
+
+static stack_count_t *
+table_slot(stack_count_t *table, size_t alloc, int *chain, int n, size_t h)
+{
+  stack_count_t *e;
+  size_t i;
+
+  for (i = h & (alloc - 1);; i = (i + 1) & (alloc - 1)) {
+    e = &table[i];
+    if (e->sites == NULL
+        || (e->hash == h && e->depth == n
+            && memcmp(e->sites, chain, n * sizeof(*chain)) == 0)) {
+      return e;
+    }
+  }
+}
+
+static void
+table_grow(void)
+{
+  stack_count_t *old = sampler.table, *e;
+  size_t i, alloc = sampler.alloc;
+
+  sampler.alloc = alloc ? alloc * 2 : 1024;
+  sampler.table = calloc(sampler.alloc, sizeof(*sampler.table));
+  if (sampler.table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (i = 0; i < alloc; i++) {
+    if (old[i].sites != NULL) {
+      e = table_slot(sampler.table, sampler.alloc, old[i].sites,
+                     old[i].depth, old[i].hash);
+      *e = old[i];
+    }
+  }
+  free(old);
+}
+
+void
+sample_take(sn_t *S, obj_t *(*prim)(sn_t *, int, obj_t **))
+{
+  stack_count_t *e;
+  size_t h;
+  int i, t, n = 0;
+
+  sample_pending = 0;
+
+  if (S->Stack_index == 0) {
+    chain_push(0, n++);
+  }
+  else {
+    /* innermost first, then turned around */
+    if (prim != NULL) {
+      chain_push(prim_site(S, prim), n++);
+    }
+    chain_push(code_site(S, S->Code), n++);
+    for (i = S->Stack_index - 1; i >= 0 && n < SAMPLE_DEPTH; i--) {
+      if (S->Stack[i].op == OP_RETURN) {
+        chain_push(code_site(S, S->Stack[i].code), n++);
+      }
+    }
+    for (i = 0; i < n / 2; i++) {
+      t = sampler.chain[i];
+      sampler.chain[i] = sampler.chain[n - 1 - i];
+      sampler.chain[n - 1 - i] = t;
+    }
+  }
+
+  if ((sampler.count + 1) * 2 > sampler.alloc) {
+    table_grow();
+  }
+  h = chain_hash(sampler.chain, n);
+  e = table_slot(sampler.table, sampler.alloc, sampler.chain, n, h);
+  if (e->sites == NULL) {
+    e->sites = malloc(sizeof(*e->sites) * n);
+    if (e->sites == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memcpy(e->sites, sampler.chain, sizeof(*e->sites) * n);
+    e->depth = n;
+    e->hash = h;
+    sampler.count++;
+  }
+  e->count++;
+}
+
+/* ';' separates frames, so it can't appear in a name */
+static void
+write_name(FILE *out, char *name)
+{
+  for (; *name != '\0'; name++) {
+    fputc(*name == ';' ? ':' : *name, out);
+  }
+}
+
+/* Stops sampling and writes out the samples. S must still be alive */
+void
+sample_stop(void)
+{
+  struct itimerval off;
+  stack_count_t *e;
+  site_t *sites;
+  FILE *out;
+  size_t i;
+  int j;
+
+  if (sampler.S == NULL) {
+    return;
+  }
+
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  sites = sampler.S->Sites;
+  sampler.S = NULL;
+
+  if ((out = fopen(sampler.path, "w")) == NULL) {
+    perror(sampler.path);
+    return;
+  }
+
+  for (i = 0; i < sampler.alloc; i++) {
+    e = &sampler.table[i];
+    if (e->sites == NULL) {
+      continue;
+    }
+    for (j = 0; j < e->depth; j++) {
+      if (j > 0) {
+        fputc(';', out);
+      }
+      write_name(out, sites[e->sites[j]].name);
+    }
+    fprintf(out, " %lu\n", e->count);
+  }
+
+  if (fclose(out) != 0) {
+    perror(sampler.path);
+  }
+}
+
+/* Profiles the rest of the run, writing the samples to `path` at exit */
+void
+sample_start(sn_t *S, char *path)
+{
+  struct sigaction sa;
+  struct itimerval it;
+
+  sampler.S = S;
+  sampler.path = path;
+  table_grow();
+  atexit(sample_stop);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sample_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0) {
+    perror("sigaction");
+    exit(1);
+  }
+
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = 1000000 / SAMPLE_HZ;
+  it.it_value = it.it_interval;
+  if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+    perror("setitimer");
+    exit(1);
+  }
+}
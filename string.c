@@ -0,0 +1,327 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "lll.h"
+
+/**
+ * String builders and string primitives.
+ *
+ * A builder appends into a STRING_T with room to spare, doubling it
+ * when it fills up, so appending is amortized O(1) per byte. Each
+ * str-append! works out how many bytes its arguments need first, so it
+ * grows the builder at most once.
+ *
+ * str-build and substr don't copy their result when it is at least
+ * SLICE_MIN bytes: they return a slice sharing the bytes of the string
+ * it came from. Appending only writes past what a builder has handed
+ * out, so those bytes never change under a slice.
+ */
+
+#define SLICE_MIN 32   /* shorter results are cheaper to copy */
+#define BUILDER_MIN 32 /* bytes of room in a new builder */
+
+/* Numbers are formatted here, the way the printer writes them */
+static writer_t scratch;
+
+/* The bytes of a string, symbol or keyword */
+static void
+str_text(obj_t *o, char **data, size_t *len, const char *name)
+{
+  if (!FLAG_P(o, ATOM_T) || o->atom.flag == FIXNUM_T
+      || o->atom.flag == FLONUM_T) {
+    fprintf(stderr, "TYPE_ERROR: %s requires strings\n", name);
+    exit(EXIT_FAILURE);
+  }
+  *data = o->atom.string.data;
+  *len = o->atom.string.length;
+}
+
+/**
+ * The text str-append! and str-concat add for `o`: a string's bytes,
+ * a symbol's name, or a number as printed, which is only good until
+ * the next call.
+ */
+static void
+str_piece(sn_t *S, obj_t *o, char **data, size_t *len, const char *name)
+{
+  if (FIXNUM_P(o) || (FLAG_P(o, ATOM_T) && (o->atom.flag == FIXNUM_T
+                                            || o->atom.flag == FLONUM_T))) {
+    scratch.len = 0;
+    write_object(S, &scratch, o);
+    *data = scratch.buf;
+    *len = scratch.len;
+    return;
+  }
+  str_text(o, data, len, name);
+}
+
+/* Bytes needed by the n pieces in argv */
+static size_t
+str_pieces_length(sn_t *S, int n, obj_t **argv, const char *name)
+{
+  char *data;
+  size_t len, total = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    str_piece(S, argv[i], &data, &len, name);
+    total += len;
+  }
+  return total;
+}
+
+/* Copies the n pieces in argv to `to` */
+static void
+str_pieces_copy(sn_t *S, int n, obj_t **argv, char *to, const char *name)
+{
+  char *data;
+  size_t len;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    str_piece(S, argv[i], &data, &len, name);
+    memcpy(to, data, len);
+    to += len;
+  }
+}
+
+static void
+str_check(obj_t *o, const char *name)
+{
+  if (!FLAG_P(o, ATOM_T) || o->atom.flag != STRING_T) {
+    fprintf(stderr, "TYPE_ERROR: %s requires a string\n", name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* `len` bytes of `str` from `start`, shared if there are enough */
+static obj_t *
+str_sub(sn_t *S, obj_t *str, size_t start, size_t len)
+{
+  obj_t *o;
+
+  if (len >= SLICE_MIN) {
+    return mk_slice(S, str, start, len);
+  }
+  GC_PROTECT(S, str);
+  o = mk_str(S, NULL, len);
+  GC_UNPROTECT(S, 1);
+  memcpy(o->atom.string.data, str->atom.string.data + start, len);
+  return o;
+}
+
+/* (str-builder [capacity]) */
+static obj_t *
+builtin_str_builder(sn_t *S, int argc, obj_t **argv)
+{
+  long n = BUILDER_MIN;
+
+  if (argc == 1) {
+    if (!FIXNUM_P(argv[0]) || FIXNUM_VAL(argv[0]) < 0) {
+      fprintf(stderr, "TYPE_ERROR: str-builder requires a size\n");
+      exit(EXIT_FAILURE);
+    }
+    n = FIXNUM_VAL(argv[0]) > 0 ? FIXNUM_VAL(argv[0]) : 1;
+  }
+  return mk_builder(S, n);
+}
+
+/* (str-append! b x ...) appends strings, symbols and numbers to b */
+static obj_t *
+builtin_str_append_b(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *b = argv[0], *bytes;
+  size_t more, need, room;
+
+  if (!FLAG_P(b, BUILDER_T)) {
+    fprintf(stderr, "TYPE_ERROR: str-append! requires a builder\n");
+    exit(EXIT_FAILURE);
+  }
+
+  more = str_pieces_length(S, argc - 1, argv + 1, "str-append!");
+
+  need = b->builder.length + more;
+  room = b->builder.bytes->atom.string.length;
+  if (need > room) {
+    while (room < need) {
+      room *= 2;
+    }
+    GC_PROTECT(S, b);
+    bytes = mk_str(S, NULL, room);
+    GC_UNPROTECT(S, 1);
+    memcpy(bytes->atom.string.data, b->builder.bytes->atom.string.data,
+           b->builder.length);
+    b->builder.bytes = bytes;
+    GC_WRITE(S, b);
+  }
+
+  str_pieces_copy(S, argc - 1, argv + 1,
+                  b->builder.bytes->atom.string.data + b->builder.length,
+                  "str-append!");
+  b->builder.length = need;
+  return b;
+}
+
+/* The contents of a builder as a string */
+static obj_t *
+builtin_str_build(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *b = argv[0];
+
+  if (!FLAG_P(b, BUILDER_T)) {
+    fprintf(stderr, "TYPE_ERROR: str-build requires a builder\n");
+    exit(EXIT_FAILURE);
+  }
+  return str_sub(S, b->builder.bytes, 0, b->builder.length);
+}
+
+/* Of a string, or of what a builder has so far */
+static obj_t *
+builtin_str_length(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *s = argv[0];
+
+  if (FLAG_P(s, BUILDER_T)) {
+    return mk_fixnum(S, s->builder.length);
+  }
+  str_check(s, "str-length");
+  return mk_fixnum(S, (long)s->atom.string.length);
+}
+
+/* (substr s start [end]) */
+static obj_t *
+builtin_substr(sn_t *S, int argc, obj_t **argv)
+{
+  long start, end;
+
+  str_check(argv[0], "substr");
+  end = (long)argv[0]->atom.string.length;
+  if (!FIXNUM_P(argv[1]) || (argc == 3 && !FIXNUM_P(argv[2]))) {
+    fprintf(stderr, "TYPE_ERROR: substr requires integer indices\n");
+    exit(EXIT_FAILURE);
+  }
+  start = FIXNUM_VAL(argv[1]);
+  if (argc == 3) {
+    end = FIXNUM_VAL(argv[2]);
+  }
+  if (start < 0 || start > end || end > (long)argv[0]->atom.string.length) {
+    fprintf(stderr, "RANGE_ERROR: substr range %ld to %ld is out of range\n",
+            start, end);
+    exit(EXIT_FAILURE);
+  }
+  return str_sub(S, argv[0], start, end - start);
+}
+
+/* (str-concat x ...) of strings, symbols and numbers, copied once */
+static obj_t *
+builtin_str_concat(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *o;
+  size_t total;
+
+  if (argc == 1 && FLAG_P(argv[0], ATOM_T)
+      && argv[0]->atom.flag == STRING_T) {
+    return argv[0];
+  }
+
+  total = str_pieces_length(S, argc, argv, "str-concat");
+  o = mk_str(S, NULL, total);
+  str_pieces_copy(S, argc, argv, o->atom.string.data, "str-concat");
+  return o;
+}
+
+/* Negative, zero or positive, as a comes before, with or after b */
+static obj_t *
+builtin_str_compare(sn_t *S, int argc, obj_t **argv)
+{
+  char *a, *b;
+  size_t alen, blen;
+  int c;
+
+  str_text(argv[0], &a, &alen, "str-compare");
+  str_text(argv[1], &b, &blen, "str-compare");
+  c = memcmp(a, b, alen < blen ? alen : blen);
+  if (c == 0) {
+    c = alen < blen ? -1 : alen > blen;
+  }
+  return MK_FIXNUM(c < 0 ? -1 : c > 0);
+}
+
+/* The number a string reads as, or () if it isn't one */
+static obj_t *
+builtin_str_to_num(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *s = argv[0];
+  char buf[64], *text, *p, *end;
+  size_t len;
+  int digits = 0, dots = 0;
+  obj_t *n;
+
+  str_check(s, "str->num");
+  len = s->atom.string.length;
+
+  /* the reader's syntax: an optional '-', digits and at most one '.' */
+  p = s->atom.string.data;
+  end = p + len;
+  if (p < end && *p == '-') {
+    p++;
+  }
+  for (; p < end; p++) {
+    if (*p >= '0' && *p <= '9') {
+      digits++;
+    }
+    else if (*p != '.' || dots++ > 0) {
+      return S->NIL;
+    }
+  }
+  if (digits == 0) {
+    return S->NIL;
+  }
+
+  text = len < sizeof(buf) ? buf : malloc(len + 1);
+  if (text == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(text, s->atom.string.data, len);
+  text[len] = '\0';
+  n = dots ? mk_flonum(S, strtod(text, NULL))
+    : mk_fixnum(S, strtol(text, NULL, 10));
+  if (text != buf) {
+    free(text);
+  }
+  return n;
+}
+
+static obj_t *
+builtin_num_to_str(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *n = argv[0];
+
+  if (!FIXNUM_P(n) && !(FLAG_P(n, ATOM_T) && (n->atom.flag == FIXNUM_T
+                                              || n->atom.flag == FLONUM_T))) {
+    fprintf(stderr, "TYPE_ERROR: num->str requires a number\n");
+    exit(EXIT_FAILURE);
+  }
+  return print_to_string(S, n);
+}
+
+static module_entry_t strings[] = {
+  { "str-builder", builtin_str_builder, 0, 1 },
+  { "str-append!", builtin_str_append_b, 1, -1 },
+  { "str-build", builtin_str_build, 1, 1 },
+  { "str-length", builtin_str_length, 1, 1 },
+  { "substr", builtin_substr, 2, 3 },
+  { "str-concat", builtin_str_concat, 0, -1 },
+  { "str-compare", builtin_str_compare, 2, 2 },
+  { "str->num", builtin_str_to_num, 1, 1 },
+  { "num->str", builtin_num_to_str, 1, 1 },
+  { NULL, NULL, 0, 0 }
+};
+
+void
+install_strings(sn_t *S)
+{
+  writer_init(&scratch, NULL);
+  module_install(S, "strings", strings);
+}
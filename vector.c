@@ -0,0 +1,867 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "lll.h"
+
+/**
+ * Numeric vectors: VECTOR_T objects holding unboxed int64 or double
+ * elements inline, so bulk operations run over contiguous memory
+ * without touching the heap.
+ *
+ * The bulk operations go through a table of kernels picked once, at
+ * install: AVX2 where the CPU has it, else SSE2 on x86-64, else plain
+ * C. Setting LLL_VECTOR_KERNELS to "sse2" or "scalar" caps the choice,
+ * to compare them. Integer kernels wrap around, like int64 arithmetic
+ * in the hardware, rather than promoting to flonums. The float sums
+ * add in a different order in each kernel, so they can differ in the
+ * last bits, and NaNs give unspecified minimums and maximums.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VEC_X86
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef struct vec_kernels {
+  const char *name;
+  int64_t (*sum_i64)(const int64_t *a, long n);
+  double (*sum_f64)(const double *a, long n);
+  int64_t (*min_i64)(const int64_t *a, long n); /* n > 0 */
+  int64_t (*max_i64)(const int64_t *a, long n);
+  double (*min_f64)(const double *a, long n);
+  double (*max_f64)(const double *a, long n);
+  int64_t (*dot_i64)(const int64_t *a, const int64_t *b, long n);
+  double (*dot_f64)(const double *a, const double *b, long n);
+  void (*add_i64)(int64_t *r, const int64_t *a, const int64_t *b, long n);
+  void (*add_f64)(double *r, const double *a, const double *b, long n);
+  void (*scale_i64)(int64_t *r, const int64_t *a, int64_t k, long n);
+  void (*scale_f64)(double *r, const double *a, double k, long n);
+} vec_kernels_t;
+
+/* Scalar kernels, the fallback. Integers wrap as unsigned */
+
+static int64_t
+scalar_sum_i64(const int64_t *a, long n)
+{
+  uint64_t s = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    s += (uint64_t)a[i];
+  }
+  return (int64_t)s;
+}
+
+static double
+scalar_sum_f64(const double *a, long n)
+{
+  double s = 0.0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    s += a[i];
+  }
+  return s;
+}
+
+static int64_t
+scalar_min_i64(const int64_t *a, long n)
+{
+  int64_t m = a[0];
+  long i;
+
+  for (i = 1; i < n; i++) {
+    m = a[i] < m ? a[i] : m;
+  }
+  return m;
+}
+
+static int64_t
+scalar_max_i64(const int64_t *a, long n)
+{
+  int64_t m = a[0];
+  long i;
+
+  for (i = 1; i < n; i++) {
+    m = a[i] > m ? a[i] : m;
+  }
+  return m;
+}
+
+static double
+scalar_min_f64(const double *a, long n)
+{
+  double m = a[0];
+  long i;
+
+  for (i = 1; i < n; i++) {
+    m = a[i] < m ? a[i] : m;
+  }
+  return m;
+}
+
+static double
+scalar_max_f64(const double *a, long n)
+{
+  double m = a[0];
+  long i;
+
+  for (i = 1; i < n; i++) {
+    m = a[i] > m ? a[i] : m;
+  }
+  return m;
+}
+
+static int64_t
+scalar_dot_i64(const int64_t *a, const int64_t *b, long n)
+{
+  uint64_t s = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    s += (uint64_t)a[i] * (uint64_t)b[i];
+  }
+  return (int64_t)s;
+}
+
+static double
+scalar_dot_f64(const double *a, const double *b, long n)
+{
+  double s = 0.0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+
+static void
+scalar_add_i64(int64_t *r, const int64_t *a, const int64_t *b, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++) {
+    r[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+  }
+}
+
+static void
+scalar_add_f64(double *r, const double *a, const double *b, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++) {
+    r[i] = a[i] + b[i];
+  }
+}
+
+static void
+scalar_scale_i64(int64_t *r, const int64_t *a, int64_t k, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++) {
+    r[i] = (int64_t)((uint64_t)a[i] * (uint64_t)k);
+  }
+}
+
+static void
+scalar_scale_f64(double *r, const double *a, double k, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++) {
+    r[i] = a[i] * k;
+  }
+}
+
+static const vec_kernels_t scalar_kernels = {
+  "scalar",
+  scalar_sum_i64, scalar_sum_f64,
+  scalar_min_i64, scalar_max_i64, scalar_min_f64, scalar_max_f64,
+  scalar_dot_i64, scalar_dot_f64,
+  scalar_add_i64, scalar_add_f64,
+  scalar_scale_i64, scalar_scale_f64
+};
+
+#ifdef VEC_X86
+/**
+ * SSE2 is part of x86-64, so these need no check. It has no 64-bit
+ * integer compare or multiply, so those stay scalar. Loads and stores
+ * are unaligned: elements are only 8-byte aligned in the heap.
+ */
+
+static int64_t
+sse2_sum_i64(const int64_t *a, long n)
+{
+  __m128i s = _mm_setzero_si128();
+  int64_t t[2];
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    s = _mm_add_epi64(s, _mm_loadu_si128((const __m128i *)(a + i)));
+  }
+  _mm_storeu_si128((__m128i *)t, s);
+  return (int64_t)((uint64_t)t[0] + (uint64_t)t[1]
+                   + (uint64_t)scalar_sum_i64(a + i, n - i));
+}
+
+static double
+sse2_sum_f64(const double *a, long n)
+{
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  double t[2];
+  long i;
+
+  /* two accumulators hide the latency of the adds */
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  return t[0] + t[1] + scalar_sum_f64(a + i, n - i);
+}
+
+static double
+sse2_min_f64(const double *a, long n)
+{
+  __m128d m = _mm_set1_pd(a[0]);
+  double t[2], r;
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    m = _mm_min_pd(m, _mm_loadu_pd(a + i));
+  }
+  _mm_storeu_pd(t, m);
+  r = t[0] < t[1] ? t[0] : t[1];
+  for (; i < n; i++) {
+    r = a[i] < r ? a[i] : r;
+  }
+  return r;
+}
+
+static double
+sse2_max_f64(const double *a, long n)
+{
+  __m128d m = _mm_set1_pd(a[0]);
+  double t[2], r;
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    m = _mm_max_pd(m, _mm_loadu_pd(a + i));
+  }
+  _mm_storeu_pd(t, m);
+  r = t[0] > t[1] ? t[0] : t[1];
+  for (; i < n; i++) {
+    r = a[i] > r ? a[i] : r;
+  }
+  return r;
+}
+
+static double
+sse2_dot_f64(const double *a, const double *b, long n)
+{
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  double t[2];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                   _mm_loadu_pd(b + i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                   _mm_loadu_pd(b + i + 2)));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  return t[0] + t[1] + scalar_dot_f64(a + i, b + i, n - i);
+}
+
+static void
+sse2_add_i64(int64_t *r, const int64_t *a, const int64_t *b, long n)
+{
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    _mm_storeu_si128((__m128i *)(r + i),
+                     _mm_add_epi64(_mm_loadu_si128((const __m128i *)(a + i)),
+                                   _mm_loadu_si128((const __m128i *)(b + i))));
+  }
+  scalar_add_i64(r + i, a + i, b + i, n - i);
+}
+
+static void
+sse2_add_f64(double *r, const double *a, const double *b, long n)
+{
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(r + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  scalar_add_f64(r + i, a + i, b + i, n - i);
+}
+
+static void
+sse2_scale_f64(double *r, const double *a, double k, long n)
+{
+  __m128d vk = _mm_set1_pd(k);
+  long i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(r + i, _mm_mul_pd(_mm_loadu_pd(a + i), vk));
+  }
+  scalar_scale_f64(r + i, a + i, k, n - i);
+}
+
+static const vec_kernels_t sse2_kernels = {
+  "sse2",
+  sse2_sum_i64, sse2_sum_f64,
+  scalar_min_i64, scalar_max_i64, sse2_min_f64, sse2_max_f64,
+  scalar_dot_i64, sse2_dot_f64,
+  sse2_add_i64, sse2_add_f64,
+  scalar_scale_i64, sse2_scale_f64
+};
+
+/* AVX2 adds a 64-bit compare, but still no 64-bit multiply */
+
+AVX2 static int64_t
+avx2_sum_i64(const int64_t *a, long n)
+{
+  __m256i s = _mm256_setzero_si256();
+  int64_t t[4];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    s = _mm256_add_epi64(s, _mm256_loadu_si256((const __m256i *)(a + i)));
+  }
+  _mm256_storeu_si256((__m256i *)t, s);
+  return (int64_t)((uint64_t)t[0] + (uint64_t)t[1] + (uint64_t)t[2]
+                   + (uint64_t)t[3] + (uint64_t)scalar_sum_i64(a + i, n - i));
+}
+
+AVX2 static double
+avx2_sum_f64(const double *a, long n)
+{
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  double t[4];
+  long i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+  return t[0] + t[1] + t[2] + t[3] + scalar_sum_f64(a + i, n - i);
+}
+
+
+AVX2 static int64_t
+avx2_min_i64(const int64_t *a, long n)
+{
+  __m256i m = _mm256_set1_epi64x(a[0]), v;
+  int64_t t[4];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    v = _mm256_loadu_si256((const __m256i *)(a + i));
+    m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+  }
+  _mm256_storeu_si256((__m256i *)t, m);
+  for (; i < n; i++) {
+    t[0] = a[i] < t[0] ? a[i] : t[0];
+  }
+  return scalar_min_i64(t, 4);
+}
+
+AVX2 static int64_t
+avx2_max_i64(const int64_t *a, long n)
+{
+  __m256i m = _mm256_set1_epi64x(a[0]), v;
+  int64_t t[4];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    v = _mm256_loadu_si256((const __m256i *)(a + i));
+    m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+  }
+  _mm256_storeu_si256((__m256i *)t, m);
+  for (; i < n; i++) {
+    t[0] = a[i] > t[0] ? a[i] : t[0];
+  }
+  return scalar_max_i64(t, 4);
+}
+
+AVX2 static double
+avx2_min_f64(const double *a, long n)
+{
+  __m256d m = _mm256_set1_pd(a[0]);
+  double t[4];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    m = _mm256_min_pd(m, _mm256_loadu_pd(a + i));
+  }
+  _mm256_storeu_pd(t, m);
+  for (; i < n; i++) {
+    t[0] = a[i] < t[0] ? a[i] : t[0];
+  }
+  return scalar_min_f64(t, 4);
+}
+
+AVX2 static double
+avx2_max_f64(const double *a, long n)
+{
+  __m256d m = _mm256_set1_pd(a[0]);
+  double t[4];
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    m = _mm256_max_pd(m, _mm256_loadu_pd(a + i));
+  }
+  _mm256_storeu_pd(t, m);
+  for (; i < n; i++) {
+    t[0] = a[i] > t[0] ? a[i] : t[0];
+  }
+  return scalar_max_f64(t, 4);
+}
+
+AVX2 static double
+avx2_dot_f64(const double *a, const double *b, long n)
+{
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  double t[4];
+  long i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                         _mm256_loadu_pd(b + i)));
+    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                         _mm256_loadu_pd(b + i + 4)));
+  }
+  _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+  return t[0] + t[1] + t[2] + t[3] + scalar_dot_f64(a + i, b + i, n - i);
+}
+
+AVX2 static void
+avx2_add_i64(int64_t *r, const int64_t *a, const int64_t *b, long n)
+{
+  __m256i x, y;
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    x = _mm256_loadu_si256((const __m256i *)(a + i));
+    y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(r + i), _mm256_add_epi64(x, y));
+  }
+  scalar_add_i64(r + i, a + i, b + i, n - i);
+}
+
+AVX2 static void
+avx2_add_f64(double *r, const double *a, const double *b, long n)
+{
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(r + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                          _mm256_loadu_pd(b + i)));
+  }
+  scalar_add_f64(r + i, a + i, b + i, n - i);
+}
+
+AVX2 static void
+avx2_scale_f64(double *r, const double *a, double k, long n)
+{
+  __m256d vk = _mm256_set1_pd(k);
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(r + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vk));
+  }
+  scalar_scale_f64(r + i, a + i, k, n - i);
+}
+
+static const vec_kernels_t avx2_kernels = {
+  "avx2",
+  avx2_sum_i64, avx2_sum_f64,
+  avx2_min_i64, avx2_max_i64, avx2_min_f64, avx2_max_f64,
+  scalar_dot_i64, avx2_dot_f64,
+  avx2_add_i64, avx2_add_f64,
+  scalar_scale_i64, avx2_scale_f64
+};
+#endif
+
+/* The CPU doesn't change, so there is one table per process */
+static const vec_kernels_t *kernels = &scalar_kernels;
+
+static void
+vec_kernels_select(void)
+{
+  char *cap = getenv("LLL_VECTOR_KERNELS");
+
+  kernels = &scalar_kernels;
+  if (cap != NULL && strcmp(cap, "scalar") == 0) {
+    return;
+  }
+#ifdef VEC_X86
+  kernels = &sse2_kernels;
+  __builtin_cpu_init();
+  if ((cap == NULL || strcmp(cap, "sse2") != 0)
+      && __builtin_cpu_supports("avx2")) {
+    kernels = &avx2_kernels;
+  }
+#endif
+}
+
+static void
+vec_check(obj_t *o, const char *name)
+{
+  if (!FLAG_P(o, VECTOR_T)) {
+    fprintf(stderr, "TYPE_ERROR: %s requires a vector\n", name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Both vectors of the same type and length */
+static void
+vec_check_pair(obj_t *a, obj_t *b, const char *name)
+{
+  vec_check(a, name);
+  vec_check(b, name);
+  if (a->vector.type != b->vector.type
+      || a->vector.length != b->vector.length) {
+    fprintf(stderr,
+            "TYPE_ERROR: %s requires vectors of the same type and length\n",
+            name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* VEC_I64 with *i for an integer, VEC_F64 with *d for a flonum */
+static int
+vec_number(obj_t *o, int64_t *i, double *d, const char *name)
+{
+  if (FIXNUM_P(o)) {
+    *i = FIXNUM_VAL(o);
+    return VEC_I64;
+  }
+  else if (FLAG_P(o, ATOM_T) && o->atom.flag == FIXNUM_T) {
+    *i = o->atom.fixnum;
+    return VEC_I64;
+  }
+  else if (FLAG_P(o, ATOM_T) && o->atom.flag == FLONUM_T) {
+    *d = o->atom.flonum;
+    return VEC_F64;
+  }
+  fprintf(stderr, "TYPE_ERROR: %s requires numbers\n", name);
+  exit(EXIT_FAILURE);
+  return 0;
+}
+
+/* Stores x at v[k], converting an integer for a VEC_F64 vector */
+static void
+vec_store(obj_t *v, long k, obj_t *x, const char *name)
+{
+  int64_t i;
+  double d;
+
+  if (vec_number(x, &i, &d, name) == VEC_I64) {
+    if (v->vector.type == VEC_I64) {
+      VECTOR_I64(v)[k] = i;
+    }
+    else {
+      VECTOR_F64(v)[k] = (double)i;
+    }
+  }
+  else if (v->vector.type == VEC_F64) {
+    VECTOR_F64(v)[k] = d;
+  }
+  else {
+    fprintf(stderr, "TYPE_ERROR: %s can't store a flonum in an i64 vector\n",
+            name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static obj_t *
+vec_box(sn_t *S, obj_t *v, long k)
+{
+  if (v->vector.type == VEC_I64) {
+    return mk_fixnum(S, (long)VECTOR_I64(v)[k]);
+  }
+  return mk_flonum(S, VECTOR_F64(v)[k]);
+}
+
+static obj_t *
+vec_from_list(sn_t *S, obj_t **argv, vec_type_t type, const char *name)
+{
+  obj_t *v, *p;
+  long n = 0, k;
+
+  for (p = argv[0]; FLAG_P(p, CONS_T); p = p->cons.cdr) {
+    n++;
+  }
+  if (p != S->NIL) {
+    fprintf(stderr, "TYPE_ERROR: %s requires a list\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  v = mk_vector(S, type, n);
+  for (p = argv[0], k = 0; k < n; p = p->cons.cdr, k++) {
+    vec_store(v, k, p->cons.car, name);
+  }
+  return v;
+}
+
+static obj_t *
+builtin_list_to_i64vec(sn_t *S, int argc, obj_t **argv)
+{
+  return vec_from_list(S, argv, VEC_I64, "list->i64vec");
+}
+
+static obj_t *
+builtin_list_to_f64vec(sn_t *S, int argc, obj_t **argv)
+{
+  return vec_from_list(S, argv, VEC_F64, "list->f64vec");
+}
+
+static obj_t *
+builtin_vec_to_list(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *v = argv[0], *x, *list = S->NIL;
+  long k;
+
+  vec_check(v, "vec->list");
+
+  GC_PROTECT(S, v);
+  GC_PROTECT(S, list);
+  for (k = v->vector.length - 1; k >= 0; k--) {
+    x = vec_box(S, v, k);
+    list = cons(S, x, list);
+  }
+  GC_UNPROTECT(S, 2);
+  return list;
+}
+
+static obj_t *
+builtin_vec_length(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *v = argv[0];
+
+  vec_check(v, "vec-length");
+  return mk_fixnum(S, v->vector.length);
+}
+
+/* The index in argv[1] into the vector in argv[0] */
+static long
+vec_index(obj_t **argv, const char *name)
+{
+  int64_t i;
+  double d;
+
+  vec_check(argv[0], name);
+  if (vec_number(argv[1], &i, &d, name) != VEC_I64) {
+    fprintf(stderr, "TYPE_ERROR: %s requires an integer index\n", name);
+    exit(EXIT_FAILURE);
+  }
+  if (i < 0 || i >= argv[0]->vector.length) {
+    fprintf(stderr, "RANGE_ERROR: %s index %ld is out of range\n",
+            name, (long)i);
+    exit(EXIT_FAILURE);
+  }
+  return (long)i;
+}
+
+static obj_t *
+builtin_vec_ref(sn_t *S, int argc, obj_t **argv)
+{
+  long k;
+
+  k = vec_index(argv, "vec-ref");
+  return vec_box(S, argv[0], k);
+}
+
+static obj_t *
+builtin_vec_set_b(sn_t *S, int argc, obj_t **argv)
+{
+  long k;
+
+  k = vec_index(argv, "vec-set!");
+  vec_store(argv[0], k, argv[2], "vec-set!");
+  return S->NIL;
+}
+
+static obj_t *
+builtin_vec_sum(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *v = argv[0];
+
+  vec_check(v, "vec-sum");
+  if (v->vector.type == VEC_I64) {
+    return mk_fixnum(S, (long)kernels->sum_i64(VECTOR_I64(v),
+                                               v->vector.length));
+  }
+  return mk_flonum(S, kernels->sum_f64(VECTOR_F64(v), v->vector.length));
+}
+
+static obj_t *
+vec_extreme(sn_t *S, obj_t *v, int max, const char *name)
+{
+  vec_check(v, name);
+  if (v->vector.length == 0) {
+    fprintf(stderr, "RANGE_ERROR: %s requires a non-empty vector\n", name);
+    exit(EXIT_FAILURE);
+  }
+  if (v->vector.type == VEC_I64) {
+    return mk_fixnum(S, (long)(max ? kernels->max_i64 : kernels->min_i64)
+                     (VECTOR_I64(v), v->vector.length));
+  }
+  return mk_flonum(S, (max ? kernels->max_f64 : kernels->min_f64)
+                   (VECTOR_F64(v), v->vector.length));
+}
+
+static obj_t *
+builtin_vec_min(sn_t *S, int argc, obj_t **argv)
+{
+  return vec_extreme(S, argv[0], 0, "vec-min");
+}
+
+static obj_t *
+builtin_vec_max(sn_t *S, int argc, obj_t **argv)
+{
+  return vec_extreme(S, argv[0], 1, "vec-max");
+}
+
+static obj_t *
+builtin_vec_dot(sn_t *S, int argc, obj_t **argv)
+{
+  long n;
+
+  vec_check_pair(argv[0], argv[1], "vec-dot");
+  n = argv[0]->vector.length;
+  if (argv[0]->vector.type == VEC_I64) {
+    return mk_fixnum(S, (long)kernels->dot_i64(VECTOR_I64(argv[0]),
+                                               VECTOR_I64(argv[1]), n));
+  }
+  return mk_flonum(S, kernels->dot_f64(VECTOR_F64(argv[0]),
+                                       VECTOR_F64(argv[1]), n));
+}
+
+static obj_t *
+builtin_vec_add(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *r;
+  long n;
+
+  vec_check_pair(argv[0], argv[1], "vec-add");
+  n = argv[0]->vector.length;
+
+  r = mk_vector(S, argv[0]->vector.type, n);
+  if (r->vector.type == VEC_I64) {
+    kernels->add_i64(VECTOR_I64(r), VECTOR_I64(argv[0]),
+                     VECTOR_I64(argv[1]), n);
+  }
+  else {
+    kernels->add_f64(VECTOR_F64(r), VECTOR_F64(argv[0]),
+                     VECTOR_F64(argv[1]), n);
+  }
+  return r;
+}
+
+/* An i64 vector only scales by an integer */
+static obj_t *
+builtin_vec_scale(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *r;
+  int64_t i = 0;
+  double d;
+  long n;
+
+  vec_check(argv[0], "vec-scale");
+  if (vec_number(argv[1], &i, &d, "vec-scale") == VEC_I64) {
+    d = (double)i;
+  }
+  else if (argv[0]->vector.type == VEC_I64) {
+    fprintf(stderr, "TYPE_ERROR: vec-scale can't scale an i64 vector "
+            "by a flonum\n");
+    exit(EXIT_FAILURE);
+  }
+  n = argv[0]->vector.length;
+
+  r = mk_vector(S, argv[0]->vector.type, n);
+  if (r->vector.type == VEC_I64) {
+    kernels->scale_i64(VECTOR_I64(r), VECTOR_I64(argv[0]), i, n);
+  }
+  else {
+    kernels->scale_f64(VECTOR_F64(r), VECTOR_F64(argv[0]), d, n);
+  }
+  return r;
+}
+
+/**
+ * (vec-map f v) calls the primitive f on each element. The result has
+ * the type of v, except that an i64 vector becomes an f64 vector from
+ * the first flonum f returns.
+ */
+static obj_t *
+builtin_vec_map(sn_t *S, int argc, obj_t **argv)
+{
+  obj_t *r, *x = S->NIL, *f64;
+  long k, j;
+
+  if (!FLAG_P(argv[0], PRIM_T)) {
+    fprintf(stderr, "TYPE_ERROR: vec-map requires a primitive\n");
+    exit(EXIT_FAILURE);
+  }
+  vec_check(argv[1], "vec-map");
+
+  r = mk_vector(S, argv[1]->vector.type, argv[1]->vector.length);
+  GC_PROTECT(S, r);
+  GC_PROTECT(S, x);
+  for (k = 0; k < argv[1]->vector.length; k++) {
+    x = vec_box(S, argv[1], k);
+    x = prim_apply(S, argv[0], 1, &x);
+    if (r->vector.type == VEC_I64 && !FIXNUM_P(x)
+        && FLAG_P(x, ATOM_T) && x->atom.flag == FLONUM_T) {
+      f64 = mk_vector(S, VEC_F64, r->vector.length);
+      for (j = 0; j < k; j++) {
+        VECTOR_F64(f64)[j] = (double)VECTOR_I64(r)[j];
+      }
+      r = f64;
+    }
+    vec_store(r, k, x, "vec-map");
+  }
+  GC_UNPROTECT(S, 2);
+  return r;
+}
+
+/* Which kernels the bulk operations use, as a string */
+static obj_t *
+builtin_vec_kernels(sn_t *S, int argc, obj_t **argv)
+{
+  return mk_str(S, (char *)kernels->name, strlen(kernels->name));
+}
+
+static module_entry_t vectors[] = {
+  { "list->i64vec", builtin_list_to_i64vec, 1, 1 },
+  { "list->f64vec", builtin_list_to_f64vec, 1, 1 },
+  { "vec->list", builtin_vec_to_list, 1, 1 },
+  { "vec-length", builtin_vec_length, 1, 1 },
+  { "vec-ref", builtin_vec_ref, 2, 2 },
+  { "vec-set!", builtin_vec_set_b, 3, 3 },
+  { "vec-sum", builtin_vec_sum, 1, 1 },
+  { "vec-min", builtin_vec_min, 1, 1 },
+  { "vec-max", builtin_vec_max, 1, 1 },
+  { "vec-dot", builtin_vec_dot, 2, 2 },
+  { "vec-add", builtin_vec_add, 2, 2 },
+  { "vec-scale", builtin_vec_scale, 2, 2 },
+  { "vec-map", builtin_vec_map, 2, 2 },
+  { "vec-kernels", builtin_vec_kernels, 0, 0 },
+  { NULL, NULL, 0, 0 }
+};
+
+void
+install_vectors(sn_t *S)
+{
+  vec_kernels_select();
+  module_install(S, "vectors", vectors);
+}